@@ -0,0 +1,388 @@
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sched.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "bench_utils.h"
+
+// Multithreaded allocator workloads, each run against glibc malloc and
+// erikmtalloc in a child process of its own:
+//
+//   larson        blocks are freed and replaced at random by a thread, then
+//                 handed over to the next thread each round (server workload)
+//   threadtest    each thread allocates and frees batches of small blocks
+//   xmalloc       producers allocate blocks that consumers free
+//   cache-scratch each thread frees a block the main thread allocated next to
+//                 the others' (passive false sharing), then allocates, writes
+//                 and frees small blocks
+//   cache-thrash  each thread allocates, writes and frees small blocks (active
+//                 false sharing)
+//   churn         random sizes from 16 bytes to 64KB allocated and freed in
+//                 random order
+//
+// Every workload does about ops allocations and frees per thread and reports
+// ops/s, peak RSS and p50/p99/p99.9 latency of every LATENCY_SAMPLE'th
+// malloc() and free().
+//
+// Usage: bench [-t threads] [-n ops] [-a glibc|erikmtalloc] [workload...]
+#define LATENCY_SAMPLE 16
+#define DEFAULT_OPS 2000000
+
+#define LARSON_BLOCKS 1000
+#define LARSON_ROUNDS 10
+#define THREADTEST_BATCH 1000
+#define XMALLOC_QUEUE 1024
+#define CACHE_WRITES 100
+#define CHURN_SLOTS 1024
+
+struct bench_config_s {
+    const allocator_s* allocator;
+    unsigned int threads;
+    uint64_t ops;
+};
+
+// Per thread state, allocating through the allocator under test and sampling
+// the latency of some of the calls
+struct bench_thread_s {
+    const allocator_s* allocator;
+    std::mt19937_64 random;
+    std::vector<uint32_t> malloc_ns;
+    std::vector<uint32_t> free_ns;
+    uint64_t ops = 0;
+    uint64_t mallocs = 0;
+    uint64_t frees = 0;
+
+    void* alloc(size_t size) {
+        ++ops;
+        if ((mallocs++ % LATENCY_SAMPLE) != 0) {
+            return allocator->malloc(size);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        void* ptr = allocator->malloc(size);
+        auto end = std::chrono::steady_clock::now();
+        malloc_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        return ptr;
+    }
+
+    void release(void* ptr) {
+        ++ops;
+        if ((frees++ % LATENCY_SAMPLE) != 0) {
+            allocator->free(ptr);
+            return;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        allocator->free(ptr);
+        auto end = std::chrono::steady_clock::now();
+        free_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    }
+};
+
+typedef struct bench_config_s bench_config_s;
+typedef struct bench_thread_s bench_thread_s;
+
+struct workload_s {
+    const char* name;
+    // Runs thread index of the workload, state is shared between its threads
+    void (*run)(const bench_config_s& config, void* state, unsigned int index, bench_thread_s* thread);
+    void* (*create)(const bench_config_s& config);
+    void (*destroy)(const bench_config_s& config, void* state);
+};
+
+typedef struct workload_s workload_s;
+
+// Larson: each thread replaces random blocks of an array, which goes to the
+// next thread every round so blocks are freed by threads that didn't
+// allocate them
+struct larson_state_s {
+    std::vector<std::vector<void*>> arrays;
+    std::barrier<> round_barrier;
+
+    larson_state_s(unsigned int threads) : arrays(threads, std::vector<void*>(LARSON_BLOCKS)), round_barrier(threads) {
+    }
+};
+
+static size_t larson_size(bench_thread_s* thread) {
+    return 16 + thread->random() % 497;
+}
+
+static void* larson_create(const bench_config_s& config) {
+    return new larson_state_s(config.threads);
+}
+
+static void larson_run(const bench_config_s& config, void* opaque, unsigned int index, bench_thread_s* thread) {
+    larson_state_s* state = static_cast<larson_state_s*>(opaque);
+    uint64_t replacements = config.ops / 2 / LARSON_ROUNDS;
+
+    for (unsigned int round = 0; round < LARSON_ROUNDS; ++round) {
+        std::vector<void*>& array = state->arrays[(index + round) % config.threads];
+        for (uint64_t i = 0; i < replacements; ++i) {
+            void*& block = array[thread->random() % LARSON_BLOCKS];
+            if (block) thread->release(block);
+            block = thread->alloc(larson_size(thread));
+        }
+        state->round_barrier.arrive_and_wait();
+    }
+
+    for (void*& block : state->arrays[index]) {
+        if (block) thread->release(block);
+        block = nullptr;
+    }
+}
+
+static void larson_destroy(const bench_config_s&, void* state) {
+    delete static_cast<larson_state_s*>(state);
+}
+
+// threadtest: allocate a batch of small blocks, then free them all
+static void threadtest_run(const bench_config_s& config, void*, unsigned int, bench_thread_s* thread) {
+    std::vector<void*> batch(THREADTEST_BATCH);
+    for (uint64_t done = 0; done < config.ops; done += 2 * THREADTEST_BATCH) {
+        for (void*& block : batch) block = thread->alloc(64);
+        for (void* block : batch) thread->release(block);
+    }
+}
+
+// xmalloc: even threads produce blocks into a queue shared with the next odd
+// thread, which frees them.  A null block ends the stream.
+struct xmalloc_queue_s {
+    alignas(64) std::atomic<uint64_t> head { 0 };
+    alignas(64) std::atomic<uint64_t> tail { 0 };
+    void* blocks[XMALLOC_QUEUE];
+};
+
+typedef struct xmalloc_queue_s xmalloc_queue_s;
+
+static void* xmalloc_create(const bench_config_s& config) {
+    return new xmalloc_queue_s[(config.threads + 1) / 2];
+}
+
+static void xmalloc_push(xmalloc_queue_s* queue, void* block) {
+    uint64_t tail = queue->tail.load(std::memory_order_relaxed);
+    while (tail - queue->head.load(std::memory_order_acquire) == XMALLOC_QUEUE) {
+        sched_yield();
+    }
+    queue->blocks[tail % XMALLOC_QUEUE] = block;
+    queue->tail.store(tail + 1, std::memory_order_release);
+}
+
+static void* xmalloc_pop(xmalloc_queue_s* queue) {
+    uint64_t head = queue->head.load(std::memory_order_relaxed);
+    while (queue->tail.load(std::memory_order_acquire) == head) {
+        sched_yield();
+    }
+    void* block = queue->blocks[head % XMALLOC_QUEUE];
+    queue->head.store(head + 1, std::memory_order_release);
+    return block;
+}
+
+static void xmalloc_run(const bench_config_s& config, void* state, unsigned int index, bench_thread_s* thread) {
+    xmalloc_queue_s* queue = &static_cast<xmalloc_queue_s*>(state)[index / 2];
+    bool has_consumer = index + 1 < config.threads;
+
+    if (index % 2 == 0) {
+        // An odd thread count leaves the last producer to free its own blocks
+        for (uint64_t i = 0; i < config.ops; i += 2) {
+            void* block = thread->alloc(8 + thread->random() % 249);
+            if (has_consumer) {
+                xmalloc_push(queue, block);
+            } else {
+                thread->release(block);
+            }
+        }
+        if (has_consumer) xmalloc_push(queue, nullptr);
+        return;
+    }
+
+    while (void* block = xmalloc_pop(queue)) {
+        thread->release(block);
+    }
+}
+
+static void xmalloc_destroy(const bench_config_s&, void* state) {
+    delete[] static_cast<xmalloc_queue_s*>(state);
+}
+
+static void cache_work(const bench_config_s& config, bench_thread_s* thread) {
+    for (uint64_t i = 0; i < config.ops; i += 2) {
+        volatile char* block = static_cast<volatile char*>(thread->alloc(8));
+        for (int write = 0; write < CACHE_WRITES; ++write) {
+            for (int j = 0; j < 8; ++j) block[j] = block[j] + 1;
+        }
+        thread->release(const_cast<char*>(block));
+    }
+}
+
+// cache-scratch: blocks allocated back to back by the main thread, one per
+// thread, likely sharing cache lines
+static void* cache_scratch_create(const bench_config_s& config) {
+    void** blocks = new void*[config.threads];
+    for (unsigned int i = 0; i < config.threads; ++i) {
+        blocks[i] = config.allocator->malloc(8);
+    }
+    return blocks;
+}
+
+static void cache_scratch_run(const bench_config_s& config, void* state, unsigned int index, bench_thread_s* thread) {
+    thread->release(static_cast<void**>(state)[index]);
+    cache_work(config, thread);
+}
+
+static void cache_scratch_destroy(const bench_config_s&, void* state) {
+    delete[] static_cast<void**>(state);
+}
+
+static void cache_thrash_run(const bench_config_s& config, void*, unsigned int, bench_thread_s* thread) {
+    cache_work(config, thread);
+}
+
+// churn: a random slot is freed if it holds a block, else gets a block of a
+// random size spread evenly over powers of two from 16 bytes to 64KB
+static void churn_run(const bench_config_s& config, void*, unsigned int, bench_thread_s* thread) {
+    std::vector<void*> slots(CHURN_SLOTS, nullptr);
+
+    while (thread->ops < config.ops) {
+        void*& slot = slots[thread->random() % CHURN_SLOTS];
+        if (slot) {
+            thread->release(slot);
+            slot = nullptr;
+        } else {
+            size_t bits = 4 + thread->random() % 12;
+            size_t size = (size_t(1) << bits) + thread->random() % (size_t(1) << bits);
+            slot = thread->alloc(size);
+            static_cast<char*>(slot)[0] = 1;
+        }
+    }
+
+    for (void* slot : slots) {
+        if (slot) thread->release(slot);
+    }
+}
+
+static void* no_state(const bench_config_s&) {
+    return nullptr;
+}
+
+static void no_destroy(const bench_config_s&, void*) {
+}
+
+static const workload_s workloads[] = {
+    { "larson", larson_run, larson_create, larson_destroy },
+    { "threadtest", threadtest_run, no_state, no_destroy },
+    { "xmalloc", xmalloc_run, xmalloc_create, xmalloc_destroy },
+    { "cache-scratch", cache_scratch_run, cache_scratch_create, cache_scratch_destroy },
+    { "cache-thrash", cache_thrash_run, no_state, no_destroy },
+    { "churn", churn_run, no_state, no_destroy },
+};
+
+static void run(const workload_s& workload, const bench_config_s& config) {
+    std::vector<bench_thread_s> threads(config.threads);
+    for (unsigned int i = 0; i < config.threads; ++i) {
+        threads[i].allocator = config.allocator;
+        threads[i].random.seed(i + 1);
+        // Fill the sample buffers now, so they don't count towards peak RSS
+        threads[i].malloc_ns.resize(config.ops / LATENCY_SAMPLE + 16);
+        threads[i].malloc_ns.clear();
+        threads[i].free_ns.resize(config.ops / LATENCY_SAMPLE + 16);
+        threads[i].free_ns.clear();
+    }
+
+    void* state = workload.create(config);
+    long baseline_kb = reset_peak_rss_kb();
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < config.threads; ++i) {
+        workers.emplace_back(workload.run, std::cref(config), state, i, &threads[i]);
+    }
+    for (std::thread& worker : workers) worker.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    long peak_kb = read_status_kb("VmHWM:") - baseline_kb;
+    workload.destroy(config, state);
+
+    uint64_t ops = 0;
+    std::vector<uint32_t> malloc_ns, free_ns;
+    for (bench_thread_s& thread : threads) {
+        ops += thread.ops;
+        malloc_ns.insert(malloc_ns.end(), thread.malloc_ns.begin(), thread.malloc_ns.end());
+        free_ns.insert(free_ns.end(), thread.free_ns.begin(), thread.free_ns.end());
+    }
+
+    printf("%-14s %-12s %3u threads %8.2f Mops/s  peak RSS %7.1f MB"
+           "  malloc p50/p99/p99.9 %5u %6u %7u ns  free %5u %6u %7u ns\n",
+        workload.name, config.allocator->name, config.threads, ops / elapsed.count() / 1e6, peak_kb / 1024.0,
+        percentile(malloc_ns, 0.5), percentile(malloc_ns, 0.99), percentile(malloc_ns, 0.999),
+        percentile(free_ns, 0.5), percentile(free_ns, 0.99), percentile(free_ns, 0.999));
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-t threads] [-n ops per thread] [-a glibc|erikmtalloc] [workload...]\nWorkloads:", name);
+    for (const workload_s& workload : workloads) fprintf(stderr, " %s", workload.name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char** argv) {
+    unsigned int threads = std::max(2u, std::thread::hardware_concurrency());
+    uint64_t ops = DEFAULT_OPS;
+    const char* only_allocator = nullptr;
+
+    int option;
+    while ((option = getopt(argc, argv, "t:n:a:h")) != -1) {
+        switch (option) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            ops = strtoull(optarg, nullptr, 10);
+            break;
+        case 'a':
+            only_allocator = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (threads == 0 || ops == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    for (int i = optind; i < argc; ++i) {
+        bool known = false;
+        for (const workload_s& workload : workloads) known |= strcmp(argv[i], workload.name) == 0;
+        if (!known) {
+            fprintf(stderr, "Unknown workload %s\n", argv[i]);
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    for (const workload_s& workload : workloads) {
+        bool selected = optind == argc;
+        for (int i = optind; i < argc; ++i) selected |= strcmp(argv[i], workload.name) == 0;
+        if (!selected) continue;
+
+        for (const allocator_s& allocator : allocators) {
+            if (only_allocator && strcmp(only_allocator, allocator.name) != 0) continue;
+
+            bench_config_s config = { &allocator, threads, ops };
+            if (!run_in_child([&] { run(workload, config); })) {
+                fprintf(stderr, "%s with %s failed\n", workload.name, allocator.name);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "erikmtalloc.h"
+
+// Shared by the benchmarks, which link the C API directly so they can run the
+// same workload against the system allocator and erikmtalloc
+
+struct allocator_s {
+    const char* name;
+    void* (*malloc)(size_t);
+    void (*free)(void*);
+    void* (*calloc)(size_t, size_t);
+    void* (*realloc)(void*, size_t);
+    void* (*aligned_alloc)(size_t, size_t);
+};
+
+typedef struct allocator_s allocator_s;
+
+static inline void* glibc_aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+static const allocator_s allocators[] = {
+    { "glibc", malloc, free, calloc, realloc, glibc_aligned_alloc },
+    { "erikmtalloc", erikmt_malloc, erikmt_free, erikmt_calloc, erikmt_realloc, erikmt_aligned_alloc },
+};
+
+// Read a kB value such as "VmRSS:" from /proc/self/status
+static inline long read_status_kb(const char* field) {
+    FILE* file = fopen("/proc/self/status", "r");
+    if (!file) return 0;
+
+    char line[256];
+    long value = 0;
+    size_t len = strlen(field);
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, field, len) == 0) {
+            value = atol(line + len);
+            break;
+        }
+    }
+    fclose(file);
+    return value;
+}
+
+// Reset the peak RSS (VmHWM) to what's resident now and return that
+static inline long reset_peak_rss_kb() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        if (write(fd, "5", 1) != 1) perror("clear_refs");
+        close(fd);
+    }
+    return read_status_kb("VmRSS:");
+}
+
+static inline uint32_t percentile(std::vector<uint32_t>& values, double p) {
+    if (values.empty()) return 0;
+    size_t index = static_cast<size_t>(p * (values.size() - 1));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+// Run function in a child process, so that one allocator's heap and peak RSS
+// don't show up in the next run.  Returns false if the child failed.
+template <typename F>
+static bool run_in_child(F function) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        function();
+        fflush(stdout);
+        _exit(0);
+    }
+
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
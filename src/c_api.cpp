@@ -0,0 +1,218 @@
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+#include "erikmtalloc.h"
+#include "erikmtalloc_internal.h"
+#include "huge.h"
+#include "pagemap.h"
+#include "profile.h"
+#include "thread_cache.h"
+#include "utils.h"
+
+using namespace std;
+
+static bool is_power_of_two(size_t n) {
+    return n && !(n & (n - 1));
+}
+
+void* erikmt_malloc(size_t size) {
+    void* ptr = tcache_alloc(size);
+
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void erikmt_free(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    tcache_free(ptr);
+}
+
+// Huge allocations always come from a fresh mmap(), which the kernel hands
+// out zeroed, so only smaller allocations need clearing
+void* erikmt_calloc(size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    void* ptr = erikmt_malloc(total);
+    if (!ptr) {
+        return nullptr;
+    }
+
+    chunk_s* chunk = pagemap_lookup(ptr);
+    if (!chunk->is_huge) {
+        memset(ptr, 0, total);
+    }
+    return ptr;
+}
+
+// Resize in place where possible: huge allocations are remapped, and
+// segments grow into free space right behind them.  Otherwise fall back to
+// allocate, copy and free.
+void* erikmt_realloc(void* ptr, size_t size) {
+    if (!ptr) {
+        return erikmt_malloc(size);
+    }
+    if (size == 0) {
+        erikmt_free(ptr);
+        return nullptr;
+    }
+
+    chunk_s* chunk = pagemap_lookup(ptr);
+    if (!chunk) {
+        debug(std::cout, "Refusing realloc of unknown ptr", ptr);
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    size_t usable_size = get_segment_size(ptr);
+
+    if (chunk->is_huge) {
+        void* moved = huge_realloc(chunk, size);
+        if (moved) {
+            if (moved != ptr) profile_record_free(ptr);
+            return moved;
+        }
+    } else if (size <= usable_size) {
+        return ptr;
+    } else if (!chunk->is_slab && size < huge_threshold) {
+        unique_lock<mutex> allocation_lock = lock_heap();
+        if (expand_segment(ptr, size)) {
+            return ptr;
+        }
+    }
+
+    // A moved block keeps its lifetime hint
+    void* new_ptr = erikmt_alloc_hint(size, static_cast<erikmt_hint>(chunk->hint));
+    if (!new_ptr) {
+        return nullptr;
+    }
+
+    memcpy(new_ptr, ptr, (usable_size < size) ? usable_size : size);
+    erikmt_free(ptr);
+
+    return new_ptr;
+}
+
+int erikmt_posix_memalign(void** out, size_t alignment, size_t size) {
+    if (!is_power_of_two(alignment) || alignment % sizeof(void*)) {
+        return EINVAL;
+    }
+
+    void* ptr = tcache_alloc_aligned(size, alignment);
+    if (!ptr) {
+        return ENOMEM;
+    }
+
+    *out = ptr;
+    return 0;
+}
+
+void* erikmt_aligned_alloc(size_t alignment, size_t size) {
+    if (!is_power_of_two(alignment)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    void* ptr = tcache_alloc_aligned(size, alignment);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+size_t erikmt_malloc_usable_size(void* ptr) {
+    if (!ptr || !pagemap_lookup(ptr)) {
+        return 0;
+    }
+
+    return get_segment_size(ptr);
+}
+
+// Grow the allocation at ptr to hold at least size bytes without moving it,
+// into the free segment or untouched chunk space behind it, or the address
+// space behind a huge mapping.  Returns false, leaving the allocation as it
+// was, if there's no room; the caller then has to allocate and copy.
+bool erikmt_try_expand(void* ptr, size_t size) {
+    chunk_s* chunk = ptr ? pagemap_lookup(ptr) : nullptr;
+    if (!chunk) {
+        return false;
+    }
+
+    if (size <= get_segment_size(ptr)) {
+        return true;
+    }
+    if (chunk->is_huge) {
+        return huge_resize_in_place(chunk, size);
+    }
+    // Slab slots have a fixed size, and segments stay below the huge threshold
+    if (chunk->is_slab || size >= huge_threshold) {
+        return false;
+    }
+
+    unique_lock<mutex> allocation_lock = lock_heap();
+    return expand_segment(ptr, size);
+}
+
+// Shrink the allocation at ptr in place to size bytes, handing the rest of
+// its segment, or the tail of its huge mapping, back to the allocator.
+// Returns whether any memory was released; the allocation stays valid for at
+// least size bytes either way.  Slab slots are never shrunk.
+bool erikmt_shrink(void* ptr, size_t size) {
+    chunk_s* chunk = ptr ? pagemap_lookup(ptr) : nullptr;
+    if (!chunk || chunk->is_slab || size >= get_segment_size(ptr)) {
+        return false;
+    }
+
+    if (chunk->is_huge) {
+        size_t mapped_size = chunk->allocated_size;
+        huge_resize_in_place(chunk, size);
+        return chunk->allocated_size < mapped_size;
+    }
+
+    unique_lock<mutex> allocation_lock = lock_heap();
+    return shrink_segment(ptr, size);
+}
+
+size_t erikmt_usable_size(void* ptr) {
+    return erikmt_malloc_usable_size(ptr);
+}
+
+// Allocate count blocks of size bytes into out, taking the allocator lock
+// once and carving them as adjacent slab slots or segments where possible.
+// Returns how many were allocated, fewer than count only if memory ran out.
+size_t erikmt_alloc_batch(size_t size, size_t count, void** out) {
+    size_t n = tcache_alloc_batch(size, count, out);
+
+    if (n < count) {
+        errno = ENOMEM;
+    }
+    return n;
+}
+
+// Free count blocks, null pointers included, taking the allocator lock once
+void erikmt_free_batch(void** ptrs, size_t count) {
+    tcache_free_batch(ptrs, count);
+}
+
+void* erikmt_alloc_hint(size_t size, erikmt_hint hint) {
+    if (hint < ERIKMT_HINT_NONE || hint >= ERIKMT_HINT_COUNT) {
+        hint = ERIKMT_HINT_NONE;
+    }
+
+    void* ptr = tcache_alloc_hint(size, hint);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
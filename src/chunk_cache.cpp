@@ -0,0 +1,469 @@
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <sys/mman.h>
+#include <system_error>
+#include <thread>
+#include <time.h>
+
+#include "chunk_cache.h"
+#include "erikmtalloc.h"
+#include "erikmtalloc_internal.h"
+#include "reserve.h"
+#include "stats.h"
+#include "thread_cache.h"
+#include "trace.h"
+#include "utils.h"
+
+// Chunks whose last allocation was freed are kept mapped in a small cache
+// instead of being munmap()ed, so that bursty workloads don't pay for a
+// munmap()/mmap() pair and the page faults behind it every time a chunk
+// empties and fills again.  Unused memory is still handed back to the kernel
+// with madvise() once it has been idle for the decay time: cached chunks as a
+// whole, and the free segments and untouched tails of live chunks.
+//
+// Purging runs opportunistically from the free path, at most once per decay
+// interval, or from a background thread started with start_purge_thread().
+// ERIKMT_DECAY_MS sets the decay time (0 purges right away, a negative value
+// never purges).
+//
+// With ERIKMT_HUGEPAGES=1, chunks are instead packed into 2MB aligned regions
+// marked MADV_HUGEPAGE, so the kernel can back them with transparent huge
+// pages and large heaps need far fewer TLB entries.  Regions are never
+// unmapped, and are only purged once every chunk in them is free, so that a
+// huge page is dropped as a whole instead of being split.
+struct cached_chunk_s {
+    char* ptr;
+    size_t size;
+    uint64_t released_at; // Milliseconds on the monotonic clock
+    bool purged;
+};
+
+// A 2MB aligned region chunks are carved from in huge page mode.  Chunks
+// are at least DEFAULT_CHUNK_SIZE, so a region never holds more than
+// REGION_MAX_CHUNKS of them.
+#define REGION_MAX_CHUNKS (HUGEPAGE_SIZE / DEFAULT_CHUNK_SIZE)
+
+struct huge_region_s {
+    char* base;
+    size_t carved; // Bytes handed out from the start of the region
+    unsigned int live_chunks;
+    unsigned int free_count; // Chunks given back while others are still live
+    size_t retained; // Bytes of freed chunks not handed out again yet
+    char* free_chunks[REGION_MAX_CHUNKS];
+    size_t free_sizes[REGION_MAX_CHUNKS];
+    uint64_t released_at;
+    bool purged;
+};
+
+// Header written over a chunk evicted from the cache, until it's unmapped
+struct evicted_chunk_s {
+    evicted_chunk_s* next;
+    size_t size;
+};
+
+typedef struct cached_chunk_s cached_chunk_s;
+typedef struct huge_region_s huge_region_s;
+typedef struct evicted_chunk_s evicted_chunk_s;
+
+// Guards the chunk cache and the huge page regions.  Taken after mut and
+// the slab class locks.  Chunks are never mmap()ed or munmap()ed under it,
+// only the 2MB regions of huge page mode are mapped under it, once each.
+static std::mutex cache_mut;
+
+// Chunks evicted from a full cache.  chunk_cache_unmap() is called with mut
+// or a slab class lock held, so instead of unmapping them there, evictions
+// are linked through the chunks themselves and unmapped by
+// chunk_cache_release_evicted() once the caller has dropped its locks.
+static std::atomic<evicted_chunk_s*> evicted_chunks{nullptr};
+
+// Stack of cached chunks, the most recently released on top, must hold
+// cache_mut
+static cached_chunk_s cached_chunks[CHUNK_CACHE_SLOTS];
+static unsigned int cached_count;
+// Must hold mut
+static uint64_t last_purge;
+
+// Region descriptors, mmap()ed on first use in huge page mode, must hold
+// cache_mut
+static huge_region_s* regions;
+static unsigned int region_count;
+
+static bool select_hugepages() {
+    const char* env = getenv("ERIKMT_HUGEPAGES");
+    if (!env || env[0] != '1') {
+        return false;
+    }
+
+    void* ptr = mmap(NULL, sizeof(huge_region_s) * HUGE_REGION_MAX, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return false;
+    }
+    regions = static_cast<huge_region_s*>(ptr);
+    return true;
+}
+
+static bool hugepages_enabled() {
+    static bool enabled = select_hugepages();
+    return enabled;
+}
+
+static long read_decay_env() {
+    const char* env = getenv("ERIKMT_DECAY_MS");
+    return env ? strtol(env, nullptr, 10) : DEFAULT_DECAY_MS;
+}
+
+static std::atomic<long>& decay_ms() {
+    static std::atomic<long> ms{read_decay_env()};
+    return ms;
+}
+
+// The coarse clock is read from the vDSO without a syscall
+uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Drop the whole pages within [start, start + size).  Lazy purges use
+// MADV_FREE, which lets the kernel reclaim the pages only under memory
+// pressure and is cheaper to refault, falling back to MADV_DONTNEED on
+// kernels without it.  In huge page mode only whole huge pages are dropped.
+void purge_pages(void* start, size_t size, bool lazy) {
+    uintptr_t pagesize = hugepages_enabled() ? HUGEPAGE_SIZE : get_pagesize();
+    uintptr_t begin = (reinterpret_cast<uintptr_t>(start) + pagesize - 1) & ~(pagesize - 1);
+    uintptr_t end = (reinterpret_cast<uintptr_t>(start) + size) & ~(pagesize - 1);
+
+    if (begin >= end) {
+        return;
+    }
+
+    stats_record_purge(end - begin);
+
+#ifdef MADV_FREE
+    if (lazy && madvise(reinterpret_cast<void*>(begin), end - begin, MADV_FREE) == 0) {
+        return;
+    }
+#endif
+    madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+}
+
+static void remove_cached(unsigned int index) {
+    for (unsigned int i = index; i + 1 < cached_count; ++i) {
+        cached_chunks[i] = cached_chunks[i + 1];
+    }
+    cached_count -= 1;
+}
+
+// mmap() an aligned region, over-mapping by a huge page and trimming
+static char* map_aligned_region() {
+    char* ptr = map_chunk(HUGEPAGE_SIZE * 2);
+    if (!ptr) {
+        return nullptr;
+    }
+
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(ptr) + HUGEPAGE_SIZE - 1) & ~static_cast<uintptr_t>(HUGEPAGE_SIZE - 1);
+    char* base = reinterpret_cast<char*>(aligned);
+    if (base > ptr) {
+        munmap(ptr, base - ptr);
+        stats_record_unmap(base - ptr);
+        trace(TRACE_MUNMAP, ptr, base - ptr);
+    }
+    munmap(base + HUGEPAGE_SIZE, ptr + HUGEPAGE_SIZE * 2 - (base + HUGEPAGE_SIZE));
+    stats_record_unmap(ptr + HUGEPAGE_SIZE * 2 - (base + HUGEPAGE_SIZE));
+    trace(TRACE_MUNMAP, base + HUGEPAGE_SIZE, ptr + HUGEPAGE_SIZE * 2 - (base + HUGEPAGE_SIZE));
+    return base;
+}
+
+// Take a 2MB aligned region for chunks, from the reserved address space if
+// possible, and ask for huge pages on it
+static huge_region_s* reserve_region() {
+    if (region_count == HUGE_REGION_MAX) {
+        return nullptr;
+    }
+
+    char* base = reserve_map(HUGEPAGE_SIZE, HUGEPAGE_SIZE);
+    if (!base) {
+        base = map_aligned_region();
+    }
+    if (!base) {
+        return nullptr;
+    }
+
+#ifdef MADV_HUGEPAGE
+    madvise(base, HUGEPAGE_SIZE, MADV_HUGEPAGE);
+#endif
+
+    debug(std::cout, "Reserved huge page region at", static_cast<void*>(base));
+
+    huge_region_s* region = &regions[region_count++];
+    region->base = base;
+    region->carved = 0;
+    region->live_chunks = 0;
+    region->free_count = 0;
+    region->retained = 0;
+    region->purged = false;
+    return region;
+}
+
+// Hand out a chunk of size bytes at ptr, which may have been freed before
+static char* take_region_chunk(huge_region_s* region, char* ptr, size_t size) {
+    size_t reused = (size < region->retained) ? size : region->retained;
+    region->retained -= reused;
+    stats_record_reuse(reused);
+
+    region->live_chunks += 1;
+    region->purged = false;
+    return ptr;
+}
+
+// Hand out a chunk of size bytes from a huge page region: one freed earlier
+// in a region that's still in use, else the unused end of a region, else a
+// new region.  Returns nullptr if size doesn't fit a region.
+static char* region_map(size_t size) {
+    if (size > HUGEPAGE_SIZE / 2) {
+        return nullptr;
+    }
+
+    for (unsigned int i = 0; i < region_count; ++i) {
+        huge_region_s* region = &regions[i];
+        for (unsigned int j = 0; j < region->free_count; ++j) {
+            if (region->free_sizes[j] == size) {
+                char* ptr = region->free_chunks[j];
+                region->free_count -= 1;
+                region->free_chunks[j] = region->free_chunks[region->free_count];
+                region->free_sizes[j] = region->free_sizes[region->free_count];
+                return take_region_chunk(region, ptr, size);
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < region_count; ++i) {
+        huge_region_s* region = &regions[i];
+        if (HUGEPAGE_SIZE - region->carved >= size) {
+            char* ptr = region->base + region->carved;
+            region->carved += size;
+            return take_region_chunk(region, ptr, size);
+        }
+    }
+
+    huge_region_s* region = reserve_region();
+    if (!region) {
+        return nullptr;
+    }
+    region->carved = size;
+    return take_region_chunk(region, region->base, size);
+}
+
+// Give a chunk back to the region it was carved from.  Once a region has no
+// live chunks left, it's carved again from the start.  Returns false if ptr
+// isn't in a region.
+static bool region_unmap(char* ptr, size_t size) {
+    for (unsigned int i = 0; i < region_count; ++i) {
+        huge_region_s* region = &regions[i];
+        if (ptr < region->base || ptr >= region->base + HUGEPAGE_SIZE) {
+            continue;
+        }
+
+        region->live_chunks -= 1;
+        region->retained += size;
+        stats_record_retain(size);
+        if (region->live_chunks == 0) {
+            region->carved = 0;
+            region->free_count = 0;
+            region->released_at = now_ms();
+        } else {
+            region->free_chunks[region->free_count] = ptr;
+            region->free_sizes[region->free_count] = size;
+            region->free_count += 1;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+// Return a mapping of exactly size bytes, reusing a cached chunk if there is
+// one.  A reused chunk isn't zeroed.  Called without any lock held, so it
+// also unmaps the chunks evicted since the last call.
+char* chunk_cache_map(size_t size) {
+    chunk_cache_release_evicted();
+
+    {
+        std::unique_lock<std::mutex> cache_lock(cache_mut);
+
+        if (hugepages_enabled()) {
+            char* ptr = region_map(size);
+            if (ptr) {
+                return ptr;
+            }
+        }
+
+        for (unsigned int i = cached_count; i-- > 0;) {
+            if (cached_chunks[i].size == size) {
+                char* ptr = cached_chunks[i].ptr;
+                debug(std::cout, "Reusing cached chunk", static_cast<void*>(ptr), "with size:", size, "bytes");
+                remove_cached(i);
+                stats_record_reuse(size);
+                return ptr;
+            }
+        }
+    }
+
+    char* ptr = reserve_map(size, get_pagesize());
+    return ptr ? ptr : map_chunk(size);
+}
+
+// Keep an empty chunk mapped for reuse, evicting the longest cached one if
+// the cache is full.  The chunk must already be dropped from the chunk list
+// and page map.  An evicted chunk is only unmapped by the next
+// chunk_cache_release_evicted(), which callers holding no lock run next.
+void chunk_cache_unmap(char* ptr, size_t size) {
+    std::unique_lock<std::mutex> cache_lock(cache_mut);
+
+    if (hugepages_enabled() && region_unmap(ptr, size)) {
+        return;
+    }
+
+    if (cached_count == CHUNK_CACHE_SLOTS) {
+        evicted_chunk_s* evicted = reinterpret_cast<evicted_chunk_s*>(cached_chunks[0].ptr);
+        evicted->size = cached_chunks[0].size;
+        stats_record_reuse(evicted->size);
+        remove_cached(0);
+
+        evicted->next = evicted_chunks.load(std::memory_order_relaxed);
+        while (!evicted_chunks.compare_exchange_weak(evicted->next, evicted, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+
+    debug(std::cout, "Caching empty chunk", static_cast<void*>(ptr), "with size:", size, "bytes");
+    cached_chunks[cached_count++] = { ptr, size, now_ms(), false };
+    stats_record_retain(size);
+}
+
+// Unmap every chunk evicted from the cache so far, must not hold any of the
+// allocator's locks
+void chunk_cache_release_evicted() {
+    if (!evicted_chunks.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    evicted_chunk_s* evicted = evicted_chunks.exchange(nullptr, std::memory_order_acquire);
+    while (evicted) {
+        // Read the header first, unmapping drops it
+        evicted_chunk_s* next = evicted->next;
+        char* ptr = reinterpret_cast<char*>(evicted);
+        size_t size = evicted->size;
+
+        if (!reserve_unmap(ptr, size)) {
+            debug(std::cout, "Chunk cache full, munmap()ing chunk", static_cast<void*>(ptr));
+            munmap(ptr, size);
+            stats_record_unmap(size);
+            trace(TRACE_MUNMAP, ptr, size);
+        }
+        evicted = next;
+    }
+}
+
+// Hold the chunk cache and reservation locks across fork()
+void chunk_cache_lock_all() {
+    cache_mut.lock();
+    reserve_lock_all();
+}
+
+void chunk_cache_unlock_all() {
+    reserve_unlock_all();
+    cache_mut.unlock();
+}
+
+// Purge cached chunks released before cutoff, and the free space of live
+// chunks, must hold mut
+static void purge(uint64_t cutoff) {
+    std::unique_lock<std::mutex> cache_lock(cache_mut);
+
+    for (unsigned int i = 0; i < cached_count; ++i) {
+        cached_chunk_s* cached = &cached_chunks[i];
+        if (!cached->purged && cached->released_at <= cutoff) {
+            // The whole chunk is idle, drop its pages from the RSS right away
+            purge_pages(cached->ptr, cached->size, false);
+            cached->purged = true;
+        }
+    }
+
+    for (unsigned int i = 0; i < region_count; ++i) {
+        huge_region_s* region = &regions[i];
+        if (region->live_chunks == 0 && !region->purged && region->released_at <= cutoff) {
+            debug(std::cout, "Purging huge page region", static_cast<void*>(region->base));
+            madvise(region->base, HUGEPAGE_SIZE, MADV_DONTNEED);
+            stats_record_purge(HUGEPAGE_SIZE);
+            region->purged = true;
+        }
+    }
+    cache_lock.unlock();
+
+    purge_free_space(cutoff);
+}
+
+// Purge whatever has been idle for the decay time, at most once per decay
+// interval, must hold mut
+void decay_tick() {
+    long decay = decay_ms().load(std::memory_order_relaxed);
+    if (decay < 0) {
+        return;
+    }
+
+    uint64_t now = now_ms();
+    if (now - last_purge < static_cast<uint64_t>(decay)) {
+        return;
+    }
+
+    debug(std::cout, "Purging memory idle for", decay, "ms");
+    last_purge = now;
+    purge(now - decay);
+}
+
+// Set how long unused memory stays resident before it's purged
+void set_decay_time(long milliseconds) {
+    decay_ms().store(milliseconds, std::memory_order_relaxed);
+}
+
+// Hand every unused page back to the kernel now
+void purge_memory() {
+    std::unique_lock<std::mutex> allocation_lock = lock_heap();
+    last_purge = now_ms();
+    purge(last_purge);
+}
+
+// Start a thread that purges idle memory in the background, so that it's
+// returned even when the application stops freeing.  Returns false if the
+// thread couldn't be created.
+bool start_purge_thread() {
+    static std::atomic<bool> started{false};
+    if (started.exchange(true)) {
+        return true;
+    }
+
+    try {
+        std::thread([]() {
+            for (;;) {
+                long decay = decay_ms().load(std::memory_order_relaxed);
+                // Check twice per interval, so nothing stays much past it
+                std::this_thread::sleep_for(std::chrono::milliseconds(decay > 0 ? decay / 2 + 1 : DEFAULT_DECAY_MS));
+
+                std::unique_lock<std::mutex> allocation_lock = lock_heap();
+                decay_tick();
+            }
+        }).detach();
+    } catch (const std::system_error&) {
+        started = false;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#define CHUNK_CACHE_SLOTS 16 // Empty chunks kept mapped for reuse
+#define DEFAULT_DECAY_MS 10000 // Idle time before unused pages are purged
+#define HUGEPAGE_SIZE (2 * 1024 * 1024) // Transparent huge page size on x86_64
+#define HUGE_REGION_MAX 65536 // Huge page regions tracked, 128GB of chunks
+
+char* chunk_cache_map(size_t size);
+uint64_t now_ms();
+void chunk_cache_unmap(char* ptr, size_t size);
+void chunk_cache_release_evicted();
+void purge_pages(void* start, size_t size, bool lazy);
+void decay_tick();
+void chunk_cache_lock_all();
+void chunk_cache_unlock_all();
@@ -0,0 +1,371 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <sched.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ 1
+#endif
+
+#include "cpu_cache.h"
+#include "erikmtalloc.h"
+#include "size_classes.h"
+#include "thread_cache.h"
+#include "utils.h"
+
+using namespace std;
+
+// Per-CPU caches of freed blocks, so that the memory held in caches and the
+// contention on them scale with the number of cores instead of the number of
+// threads.  Each CPU keeps a bounded stack of blocks per size class.
+//
+// With restartable sequences (glibc >= 2.35 registers them for every thread)
+// a push or pop is a short instruction sequence that reads the current CPU
+// and commits with a single store; if the thread is preempted or migrated
+// before the commit, the kernel restarts it at the abort handler.  Without
+// rseq, the CPU comes from sched_getcpu() and its cache is guarded by a
+// spinlock.  Set ERIKMT_CPU_CACHE=0 to use per-thread caches instead.
+#define CPU_CACHE_SLOTS (CACHE_MAX_BATCH * 2)
+
+// Blocks cached for one size class on one CPU.  The rseq sequences rely on
+// count being first and the slots starting at offset 8.
+struct cpu_bin_s {
+    uint32_t count;
+    uint32_t unused;
+    void* slots[CPU_CACHE_SLOTS];
+};
+
+struct cpu_cache_s {
+    cpu_bin_s bins[SIZE_CLASS_COUNT];
+    std::atomic_flag lock; // Only used without rseq
+};
+
+typedef struct cpu_bin_s cpu_bin_s;
+typedef struct cpu_cache_s cpu_cache_s;
+
+enum cpu_cache_mode {
+    MODE_OFF,
+    MODE_SCHED_GETCPU,
+    MODE_RSEQ,
+};
+
+// One cpu_cache_s per possible CPU, mmap()ed on first use.  Zeroed memory is
+// a valid set of empty bins with unlocked spinlocks.
+static cpu_cache_s* cpu_caches;
+
+static cpu_cache_mode select_mode() {
+    const char* env = getenv("ERIKMT_CPU_CACHE");
+    if (env && env[0] == '0') {
+        return MODE_OFF;
+    }
+
+    void* ptr = mmap(NULL, sizeof(cpu_cache_s) * CPU_CACHE_MAX_CPUS, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return MODE_OFF;
+    }
+    cpu_caches = static_cast<cpu_cache_s*>(ptr);
+
+#ifdef HAVE_RSEQ
+    if (__rseq_size > 0) {
+        return MODE_RSEQ;
+    }
+#endif
+    return MODE_SCHED_GETCPU;
+}
+
+static cpu_cache_mode get_mode() {
+    static cpu_cache_mode mode = select_mode();
+    return mode;
+}
+
+bool cpu_cache_enabled() {
+    return get_mode() != MODE_OFF;
+}
+
+// Most blocks a CPU caches for a size class before flushing a batch
+static uint32_t bin_capacity(size_t index) {
+    return size_class_batch(index) * 2;
+}
+
+#ifdef HAVE_RSEQ
+// Descriptor of the critical section between labels 1 and 2, with its abort
+// handler at label 4.  The kernel requires the abort handler to be preceded
+// by RSEQ_SIG (0x53053053, the signature glibc registers with).
+#define RSEQ_CS_TABLE \
+    ".pushsection __rseq_cs, \"aw\"\n\t" \
+    ".balign 32\n\t" \
+    "3:\n\t" \
+    ".long 0x0, 0x0\n\t" \
+    ".quad 1f, (2f - 1f), 4f\n\t" \
+    ".popsection\n\t"
+
+#define RSEQ_CS_ABORT(label) \
+    ".pushsection __rseq_failure, \"ax\"\n\t" \
+    ".byte 0x0f, 0xb9, 0x3d\n\t" \
+    ".long 0x53053053\n\t" \
+    "4:\n\t" \
+    "jmp %l[" #label "]\n\t" \
+    ".popsection\n\t"
+
+// Read the CPU the thread is on from its rseq area, which is negative
+// (huge as unsigned) if rseq isn't registered for this thread
+static uint32_t rseq_cpu() {
+    volatile struct rseq* area = reinterpret_cast<volatile struct rseq*>(
+        static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+    return area->cpu_id;
+}
+
+// Push ptr onto the current CPU's bin, returns false if the bin is full or
+// the thread has no usable CPU
+static bool rseq_push(size_t index, void* ptr) {
+    cpu_bin_s* bins = &cpu_caches[0].bins[index];
+    uint32_t capacity = bin_capacity(index);
+
+retry:
+    __asm__ goto (
+        RSEQ_CS_TABLE
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %%fs:%c[cs_offset](%[rseq])\n\t"
+        "1:\n\t"
+        "movl %%fs:%c[cpu_offset](%[rseq]), %%eax\n\t"
+        "cmpl %[max_cpus], %%eax\n\t"
+        "jae %l[full]\n\t"
+        "imulq %[stride], %%rax\n\t"
+        "addq %[bins], %%rax\n\t"
+        "movl (%%rax), %%ecx\n\t"
+        "cmpl %[capacity], %%ecx\n\t"
+        "jae %l[full]\n\t"
+        "movq %[ptr], 8(%%rax, %%rcx, 8)\n\t"
+        "addl $1, %%ecx\n\t"
+        // Commit
+        "movl %%ecx, (%%rax)\n\t"
+        "2:\n\t"
+        RSEQ_CS_ABORT(abort)
+        :
+        : [rseq] "r"(__rseq_offset),
+          [cs_offset] "i"(offsetof(struct rseq, rseq_cs)),
+          [cpu_offset] "i"(offsetof(struct rseq, cpu_id)),
+          [max_cpus] "i"(CPU_CACHE_MAX_CPUS),
+          [stride] "i"(sizeof(cpu_cache_s)),
+          [bins] "r"(bins),
+          [capacity] "r"(capacity),
+          [ptr] "r"(ptr)
+        : "rax", "rcx", "memory", "cc"
+        : full, abort);
+    return true;
+abort:
+    goto retry;
+full:
+    return false;
+}
+
+// Pop a block from the current CPU's bin, returns nullptr if the bin is
+// empty or the thread has no usable CPU
+static void* rseq_pop(size_t index) {
+    cpu_bin_s* bins = &cpu_caches[0].bins[index];
+    void* ptr;
+
+retry:
+    __asm__ goto (
+        RSEQ_CS_TABLE
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %%fs:%c[cs_offset](%[rseq])\n\t"
+        "1:\n\t"
+        "movl %%fs:%c[cpu_offset](%[rseq]), %%eax\n\t"
+        "cmpl %[max_cpus], %%eax\n\t"
+        "jae %l[empty]\n\t"
+        "imulq %[stride], %%rax\n\t"
+        "addq %[bins], %%rax\n\t"
+        "movl (%%rax), %%ecx\n\t"
+        "testl %%ecx, %%ecx\n\t"
+        "jz %l[empty]\n\t"
+        // slots[count - 1] sits at offset 8 * count
+        "movq (%%rax, %%rcx, 8), %%rdx\n\t"
+        "movq %%rdx, (%[out])\n\t"
+        "subl $1, %%ecx\n\t"
+        // Commit
+        "movl %%ecx, (%%rax)\n\t"
+        "2:\n\t"
+        RSEQ_CS_ABORT(abort)
+        :
+        : [rseq] "r"(__rseq_offset),
+          [cs_offset] "i"(offsetof(struct rseq, rseq_cs)),
+          [cpu_offset] "i"(offsetof(struct rseq, cpu_id)),
+          [max_cpus] "i"(CPU_CACHE_MAX_CPUS),
+          [stride] "i"(sizeof(cpu_cache_s)),
+          [bins] "r"(bins),
+          [out] "r"(&ptr)
+        : "rax", "rcx", "rdx", "memory", "cc"
+        : empty, abort);
+    return ptr;
+abort:
+    goto retry;
+empty:
+    return nullptr;
+}
+#endif
+
+// Lock and return the current CPU's cache, or nullptr if the CPU is unknown
+static cpu_cache_s* lock_cpu_cache() {
+    int cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= CPU_CACHE_MAX_CPUS) {
+        return nullptr;
+    }
+
+    cpu_cache_s* cache = &cpu_caches[cpu];
+    while (cache->lock.test_and_set(std::memory_order_acquire)) {
+        sched_yield();
+    }
+    return cache;
+}
+
+static void* cpu_pop(size_t index) {
+#ifdef HAVE_RSEQ
+    if (get_mode() == MODE_RSEQ) {
+        return rseq_pop(index);
+    }
+#endif
+
+    cpu_cache_s* cache = lock_cpu_cache();
+    if (!cache) {
+        return nullptr;
+    }
+
+    cpu_bin_s* bin = &cache->bins[index];
+    void* ptr = bin->count ? bin->slots[--bin->count] : nullptr;
+
+    cache->lock.clear(std::memory_order_release);
+    return ptr;
+}
+
+static bool cpu_push(size_t index, void* ptr) {
+#ifdef HAVE_RSEQ
+    if (get_mode() == MODE_RSEQ) {
+        return rseq_push(index, ptr);
+    }
+#endif
+
+    cpu_cache_s* cache = lock_cpu_cache();
+    if (!cache) {
+        return false;
+    }
+
+    cpu_bin_s* bin = &cache->bins[index];
+    bool pushed = bin->count < bin_capacity(index);
+    if (pushed) {
+        bin->slots[bin->count++] = ptr;
+    }
+
+    cache->lock.clear(std::memory_order_release);
+    return pushed;
+}
+
+// Whether the calling thread runs on a CPU that has a cache
+static bool cpu_usable() {
+#ifdef HAVE_RSEQ
+    if (get_mode() == MODE_RSEQ) {
+        return rseq_cpu() < CPU_CACHE_MAX_CPUS;
+    }
+#endif
+
+    int cpu = sched_getcpu();
+    return cpu >= 0 && cpu < CPU_CACHE_MAX_CPUS;
+}
+
+// Serve a block of the size class from the current CPU's cache.  An empty
+// bin is refilled with a batch from the shared heap under a single lock
+// acquisition, pushing the blocks onto whichever CPU the thread is on by then.
+void* cpu_cache_alloc(size_t index) {
+    void* ptr = cpu_pop(index);
+    if (ptr) {
+        return ptr;
+    }
+
+    size_t class_size = size_class_size(index);
+    void* batch[CACHE_MAX_BATCH];
+    unsigned int count = 0;
+
+    if (!cpu_usable()) {
+        unique_lock<mutex> allocation_lock = lock_heap_for(class_size);
+        return get_segment(class_size);
+    }
+
+    debug(std::cout, "Refilling CPU cache class", class_size, "with", size_class_batch(index), "blocks");
+
+    {
+        unique_lock<mutex> allocation_lock = lock_heap_for(class_size);
+        count = get_segments(class_size, size_class_batch(index), batch);
+    }
+
+    if (count == 0) {
+        return nullptr;
+    }
+
+    // The last block carved goes to the caller
+    unsigned int i = 0;
+    while (i < count - 1 && cpu_push(index, batch[i])) {
+        ++i;
+    }
+
+    if (i < count - 1) {
+        heap_free_batch(batch + i, count - 1 - i);
+    }
+
+    return batch[count - 1];
+}
+
+// Cache a freed block on the current CPU.  If the bin is full, a batch is
+// moved back to the shared heap first, keeping the most recently freed block.
+// Neither step ever waits for mut.
+void cpu_cache_free(size_t index, void* ptr) {
+    if (cpu_push(index, ptr)) {
+        return;
+    }
+
+    void* batch[CACHE_MAX_BATCH + 1];
+    unsigned int count = 0;
+
+    if (cpu_usable()) {
+        while (count < size_class_batch(index)) {
+            void* block = cpu_pop(index);
+            if (!block) break;
+            batch[count++] = block;
+        }
+        debug(std::cout, "Flushing", count, "blocks from CPU cache class", size_class_size(index));
+    }
+
+    if (count == 0 || !cpu_push(index, ptr)) {
+        batch[count++] = ptr;
+    }
+
+    heap_free_batch(batch, count);
+}
+
+// Hold every CPU's spinlock across fork() when running without rseq.  Once
+// the caches exist, the mode has been picked.
+void cpu_cache_lock_all() {
+    if (!cpu_caches || get_mode() != MODE_SCHED_GETCPU) {
+        return;
+    }
+
+    for (int cpu = 0; cpu < CPU_CACHE_MAX_CPUS; ++cpu) {
+        while (cpu_caches[cpu].lock.test_and_set(std::memory_order_acquire)) {
+            sched_yield();
+        }
+    }
+}
+
+void cpu_cache_unlock_all() {
+    if (!cpu_caches || get_mode() != MODE_SCHED_GETCPU) {
+        return;
+    }
+
+    for (int cpu = 0; cpu < CPU_CACHE_MAX_CPUS; ++cpu) {
+        cpu_caches[cpu].lock.clear(std::memory_order_release);
+    }
+}
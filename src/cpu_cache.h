@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstddef>
+
+#define CPU_CACHE_MAX_CPUS 256 // CPUs beyond this go straight to the shared heap
+
+bool cpu_cache_enabled();
+void* cpu_cache_alloc(size_t index);
+void cpu_cache_free(size_t index, void* ptr);
+void cpu_cache_lock_all();
+void cpu_cache_unlock_all();
@@ -1,3 +1,4 @@
+#include <atomic>
 #include <cstdint>
 #include <ios>
 #include <ostream>
@@ -7,43 +8,57 @@
 #include <thread>
 #include <mutex>
 
+#include "chunk_cache.h"
 #include "erikmtalloc.h"
+#include "erikmtalloc_internal.h"
+#include "free_index.h"
+#include "huge.h"
+#include "pagemap.h"
+#include "size_classes.h"
+#include "slab.h"
+#include "stats.h"
+#include "thread_cache.h"
+#include "trace.h"
 #include "utils.h"
 
-#define DEFAULT_CHUNK_SIZE 1024*256 // 256KB chunks
-
-// Structure for segments allocated inside of an MMAPed "chunk"
-struct segment_s {
-    segment_s* next;
-    size_t size;
-    bool is_allocated;
-    bool is_footer;
-};
-
-// mmap()'ed parent "chunks", on which variable size "segments" are allocated
-struct chunk_s {
-    chunk_s* next;
-    size_t allocated_size;
-    size_t remaining_size;
-    bool is_allocated;
-    bool is_footer;
-    bool is_parent;
-    int total_allocations = 0;
-    segment_s* next_segment;
-};
-
-typedef struct chunk_s chunk_s;
-typedef struct segment_s segment_s;
-
-// Linked list to track allocations for re-use/cleanup
+// Linked list to track allocations for re-use/cleanup, running through each
+// chunk's header and footer.  tail is the last chunk's footer.
 chunk_s* root;
 chunk_s* cur;
-size_t pagesize = sysconf(_SC_PAGE_SIZE);
+static chunk_s* tail;
+
+// Free segments by size, linked through their payloads, and segment chunks
+// by the size of their untouched space, linked through free_space_node.
+// Both must hold mut.  Every free segment of at least FREE_INDEX_MIN_SIZE
+// bytes is in free_segments, so a request finds a reusable segment or a
+// chunk with room for it without walking the chunk list.  Chunks of each
+// erikmt_hint are indexed apart, so hinted blocks never share a chunk with
+// blocks of another hint.
+static free_index_s free_segments[ERIKMT_HINT_COUNT];
+static free_index_s free_spaces[ERIKMT_HINT_COUNT];
+
+// Chunk the last segment of each hint was carved from.  It's carved from
+// again while it has room, so that segments allocated one after the other
+// sit side by side.
+static chunk_s* carving[ERIKMT_HINT_COUNT];
+
+static void index_free_space(chunk_s* chunk);
+
+// Blocks freed while another thread held mut, linked through their first
+// word.  Any thread pushes with a CAS, the next holder of mut drains it.
+static std::atomic<void*> remote_frees{nullptr};
+
+// Looked up on first use instead of in a static initializer, since malloc()
+// may be called through the preload library before our constructors run
+size_t get_pagesize() {
+    static size_t pagesize = sysconf(_SC_PAGE_SIZE);
+    return pagesize;
+}
 
 // Add a header and footer identifying metadata for new chunk,
 // then add the chunk to the chunk map list.
 // Add footer to end of allocation
-void tag_chunk(char *chunk, size_t aligned_size) {
+void tag_chunk(char *chunk, size_t aligned_size, erikmt_hint hint) {
     struct chunk_s* footer = reinterpret_cast<chunk_s*>(static_cast<char*>(chunk) + (aligned_size - sizeof(chunk_s)));
     debug(std::cout, "writing CHUNK footer at", footer);
     
@@ -54,52 +69,61 @@ void tag_chunk(char *chunk, size_t aligned_size) {
     footer->is_allocated = false;
     footer->is_footer = true;
     footer->is_parent = true;
-    footer->next_segment = nullptr;
+    footer->is_slab = false;
+    footer->is_huge = false;
+    footer->hint = hint;
 
     struct chunk_s* header = reinterpret_cast<chunk_s*>((static_cast<char*>(chunk)));
     debug(std::cout, "writing CHUNK header at", header);
 
     header->next = footer;
-    header->allocated_size = aligned_size - pagesize;
-    header->remaining_size = aligned_size - pagesize;
+    header->allocated_size = aligned_size - get_pagesize();
+    header->remaining_size = aligned_size - get_pagesize();
     header->is_allocated = false;
     header->is_footer = false;
     header->is_parent = true;
-    header->next_segment = nullptr;
+    header->is_slab = false;
+    header->is_huge = false;
+    header->hint = hint;
+    header->total_allocations = 0;
+    header->free_space_node.released_at = now_ms();
+    header->free_space_node.purged = false;
+    index_free_space(header);
 
     if (!cur) {
         // This is the first segment allocated
         root = header;
         cur = header;
     } else {
-        chunk_s* a = cur;
-        while (a->next) {
-            a = a->next;
-        }
-        a->next = header;
+        tail->next = header;
     }
+    tail = footer;
+
+    pagemap_register(chunk, aligned_size, header);
 }
 
 // Align to OS page size
 size_t align_to_pagesize(size_t size) {
+    size_t pagesize = get_pagesize();
     return static_cast<size_t>(size + (pagesize - (size % pagesize)));
 }
 
-// Align size to next nearest 4 byte boundary
-size_t align_4(size_t size) {
-    return static_cast<size_t>(size + (4 - (size % 4)));
+// Align a payload size to MIN_ALIGNMENT, so that the payload of the segment
+// behind it stays aligned too
+size_t align_segment(size_t size) {
+    return (size + MIN_ALIGNMENT - 1) & ~static_cast<size_t>(MIN_ALIGNMENT - 1);
 }
 
-// Return size required (rounded up to nearest 4-byte boundary) including
+// Return size required (rounded up to the segment alignment) including
 // additional segment header/footer that will be allocated
 size_t get_padded_size(size_t size) {
-    return static_cast<size_t>(align_4(size + sizeof(segment_s)*2));
+    return align_segment(size) + sizeof(segment_s)*2;
 }
 
 // Get a pointer to the first byte of the payload section
 // from a segment_s header
-void* get_payload(uintptr_t& addr) {
-    return reinterpret_cast<void *>(align_4(addr + sizeof(segment_s)));
+void* get_payload(segment_s* header) {
+    return reinterpret_cast<char*>(header) + sizeof(segment_s);
 }
 
 // Get a pointer to the header struct of payload
@@ -107,11 +131,276 @@ void* get_header(void* ptr) {
     return reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(ptr) - (sizeof(segment_s)));
 }
 
+// Segments are laid out back to back from the end of the chunk header:
+// [header][payload][footer][header][payload][footer]... with each payload
+// exactly header->size bytes, so the footer of the previous segment always
+// sits right in front of a header (boundary tags).  The first header starts 8
+// bytes short of an aligned address, so that every payload is aligned.
+static char* get_segment_area(chunk_s* chunk) {
+    return reinterpret_cast<char*>(chunk) + align_segment(sizeof(chunk_s) + sizeof(segment_s)) - sizeof(segment_s);
+}
+
+// Where the chunk's untouched space begins, right behind the last segment
+static char* get_free_space(chunk_s* chunk) {
+    return get_segment_area(chunk) + (chunk->allocated_size - chunk->remaining_size);
+}
+
+static segment_s* get_footer(segment_s* header) {
+    return reinterpret_cast<segment_s*>(static_cast<char*>(get_payload(header)) + header->size);
+}
+
+// Return the first segment carved from chunk, or nullptr if there's none
+static segment_s* get_first_segment(chunk_s* chunk) {
+    char* area = get_segment_area(chunk);
+    return (area == get_free_space(chunk)) ? nullptr : reinterpret_cast<segment_s*>(area);
+}
+
+// Return the segment physically following header, or nullptr if header is
+// the last segment carved from its chunk
+static segment_s* get_next_segment(chunk_s* chunk, segment_s* header) {
+    segment_s* next = get_footer(header) + 1;
+    return (reinterpret_cast<char*>(next) == get_free_space(chunk)) ? nullptr : next;
+}
+
+// Return the footer of the segment physically preceding header, or nullptr
+// if header is the first segment in its chunk
+static segment_s* get_prev_footer(chunk_s* chunk, segment_s* header) {
+    if (reinterpret_cast<char*>(header) == get_segment_area(chunk)) {
+        return nullptr;
+    }
+    return header - 1;
+}
+
+static segment_s* get_header_from_footer(segment_s* footer) {
+    return reinterpret_cast<segment_s*>(reinterpret_cast<char*>(footer) - footer->size - sizeof(segment_s));
+}
+
+// Write a header/footer pair for a segment with size bytes of payload
+static segment_s* write_segment(char* addr, size_t size, bool is_allocated) {
+    segment_s* header = reinterpret_cast<segment_s*>(addr);
+    *header = segment_s { size, is_allocated, false, 0 };
+    *get_footer(header) = segment_s { size, is_allocated, true, 0 };
+    return header;
+}
+
+static free_node_s* get_free_node(segment_s* header) {
+    return static_cast<free_node_s*>(get_payload(header));
+}
+
+static segment_s* get_segment_from_node(free_node_s* node) {
+    return static_cast<segment_s*>(get_header(node));
+}
+
+// Add a free segment of chunk to free_segments, or take it out again.
+// Segments too small to hold a free_node_s stay out, until coalesced with a
+// neighbour.  Its pages have been idle since released_at, and were already
+// purged if purged is set.
+static void index_segment(chunk_s* chunk, segment_s* header, uint64_t released_at, bool purged) {
+    if (header->size >= FREE_INDEX_MIN_SIZE) {
+        free_node_s* node = get_free_node(header);
+        node->released_at = released_at;
+        node->purged = purged;
+        free_index_insert(&free_segments[chunk->hint], node, header->size);
+    }
+}
+
+// When a free segment was released, or now if it's too small to say.  A
+// segment split off it has been idle just as long.
+static uint64_t get_released_at(segment_s* header) {
+    return (header->size >= FREE_INDEX_MIN_SIZE) ? get_free_node(header)->released_at : now_ms();
+}
+
+static bool is_purged(segment_s* header) {
+    return header->size >= FREE_INDEX_MIN_SIZE && get_free_node(header)->purged;
+}
+
+static void unindex_segment(chunk_s* chunk, segment_s* header) {
+    if (header->size >= FREE_INDEX_MIN_SIZE) {
+        free_index_remove(&free_segments[chunk->hint], get_free_node(header));
+    }
+}
+
+// Same for the untouched space of a chunk, which can run out entirely
+static void index_free_space(chunk_s* chunk) {
+    if (chunk->remaining_size >= FREE_INDEX_MIN_SIZE) {
+        free_index_insert(&free_spaces[chunk->hint], &chunk->free_space_node, chunk->remaining_size);
+    }
+}
+
+static void unindex_free_space(chunk_s* chunk) {
+    if (chunk->remaining_size >= FREE_INDEX_MIN_SIZE) {
+        free_index_remove(&free_spaces[chunk->hint], &chunk->free_space_node);
+    }
+}
+
+// Resize the chunk's untouched space, moving it to its new bin in free_spaces
+static void set_remaining_size(chunk_s* chunk, size_t size) {
+    unindex_free_space(chunk);
+    chunk->remaining_size = size;
+    index_free_space(chunk);
+}
+
+static void coalesce_segment(chunk_s* chunk, segment_s* header);
+
+// Shrink an allocated segment to size bytes (already aligned) if the tail
+// could hold another allocation, turning the tail into a new free segment.
+// The caller indexes the tail or coalesces it with what follows.
+static bool split_segment(segment_s* header, size_t size) {
+    if (header->size < get_padded_size(size) + SEGMENT_MIN_SPLIT) {
+        return false;
+    }
+
+    size_t rest_size = header->size - get_padded_size(size);
+    char* rest = static_cast<char*>(get_payload(header)) + size + sizeof(segment_s);
+    write_segment(rest, rest_size, false);
+
+    debug(std::cout, "Splitting off free segment", static_cast<void*>(rest), "with size:", rest_size);
+    write_segment(reinterpret_cast<char*>(header), size, true);
+
+    return true;
+}
+
+// Return the usable size of an allocated payload, either its slab slot size
+// or the size recorded in its segment header.  Only reads the caller's own
+// header (and the lock-free page map), so it doesn't require the global lock.
+size_t get_segment_size(void* ptr) {
+    chunk_s* chunk = pagemap_lookup(ptr);
+    if (chunk && chunk->is_slab) {
+        return slab_block_size(chunk);
+    }
+    if (chunk && chunk->is_huge) {
+        return huge_usable_size(chunk);
+    }
+
+    return static_cast<segment_s*>(get_header(ptr))->size;
+}
+
+// Resize a huge allocation through mremap(), without copying.  Returns the
+// (possibly moved) payload, or nullptr if ptr isn't a huge allocation or the
+// mapping couldn't be resized; the caller then has to allocate and copy.
+void* resize_segment(void* ptr, size_t size) {
+    chunk_s* chunk = pagemap_lookup(ptr);
+    if (!chunk || !chunk->is_huge) {
+        return nullptr;
+    }
+
+    return huge_realloc(chunk, size);
+}
+
+// Grow the segment owning ptr in place to hold size bytes, by taking over the
+// free segment behind it or, for the last segment, the chunk's untouched
+// space.  Returns false if ptr isn't a segment allocation or there isn't
+// enough room next to it.  Must hold mut.
+bool expand_segment(void* ptr, size_t size) {
+    chunk_s* chunk = pagemap_lookup(ptr);
+    if (!chunk || chunk->is_slab || chunk->is_huge) {
+        return false;
+    }
+
+    segment_s* header = static_cast<segment_s*>(get_header(ptr));
+    size = align_segment(size);
+
+    if (header->size >= size) {
+        return true;
+    }
+
+    segment_s* next = get_next_segment(chunk, header);
+
+    if (next == nullptr) {
+        size_t extra = size - header->size;
+        if (chunk->remaining_size < extra) {
+            return false;
+        }
+
+        debug(std::cout, "Expanding segment", header, "into chunk free space by", extra, "bytes");
+        stats_record_free(header->size);
+        set_remaining_size(chunk, chunk->remaining_size - extra);
+        write_segment(reinterpret_cast<char*>(header), size, true);
+        stats_record_alloc(header->size);
+        return true;
+    }
+
+    if (next->is_allocated || header->size + get_padded_size(next->size) < size) {
+        return false;
+    }
+
+    debug(std::cout, "Expanding segment", header, "into free segment", next);
+    stats_record_free(header->size);
+    uint64_t released_at = get_released_at(next);
+    bool purged = is_purged(next);
+    unindex_segment(chunk, next);
+    write_segment(reinterpret_cast<char*>(header), header->size + get_padded_size(next->size), true);
+    // The free segment was followed by an allocated one, or it would have
+    // been handed back to the chunk's free space
+    if (split_segment(header, size)) {
+        index_segment(chunk, get_footer(header) + 1, released_at, purged);
+    }
+    stats_record_alloc(header->size);
+
+    return true;
+}
+
+// Shrink the segment owning ptr in place to size bytes, handing the tail
+// back as free space.  Returns false if ptr isn't a segment allocation or the
+// tail would be too small to be worth splitting off.  Must hold mut.
+bool shrink_segment(void* ptr, size_t size) {
+    chunk_s* chunk = pagemap_lookup(ptr);
+    if (!chunk || chunk->is_slab || chunk->is_huge) {
+        return false;
+    }
+
+    segment_s* header = static_cast<segment_s*>(get_header(ptr));
+    size_t old_size = header->size;
+
+    if (!split_segment(header, align_segment(size))) {
+        return false;
+    }
+
+    debug(std::cout, "Shrunk segment", header, "from", old_size, "to", header->size, "bytes");
+    stats_record_free(old_size);
+    stats_record_alloc(header->size);
+    coalesce_segment(chunk, get_footer(header) + 1);
+
+    return true;
+}
+
+// Requests of at least size bytes get a dedicated mapping.  Anything up to
+// SLAB_MAX_SIZE always stays in the slabs.
+void set_huge_threshold(size_t size) {
+    huge_threshold = (size > SLAB_MAX_SIZE) ? size : SLAB_MAX_SIZE + 1;
+}
+
+// mmap() a new region for a chunk, returns nullptr if the kernel refuses
+char* map_chunk(size_t aligned_size) {
+    void* ptr = mmap(NULL, aligned_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (ptr == MAP_FAILED) {
+        debug(std::cout, "mmap() failed for chunk of size:", aligned_size, "bytes");
+        return nullptr;
+    }
+
+    stats_record_map(aligned_size);
+    trace(TRACE_MMAP, ptr, aligned_size);
+    return static_cast<char*>(ptr);
+}
+
+// Drops mut for the scope it's declared in and takes it back on the way out,
+// so that chunks are mapped without holding up other threads.  Must hold mut.
+struct heap_unlock_s {
+    heap_unlock_s() { mut.unlock(); }
+    ~heap_unlock_s() { mut.lock(); }
+    heap_unlock_s(const heap_unlock_s&) = delete;
+    heap_unlock_s& operator=(const heap_unlock_s&) = delete;
+};
+
+typedef struct heap_unlock_s heap_unlock_s;
+
 // Add a chunk capable of containing at least the size passed.  By default, create
 // a large chunk (specified by DEFAULT_CHUNK_SIZE), unless new() requires more memory
 // than the chunk size, in which case, create a chunk aligned up to the nearest page
-// beyond the requested size.
-size_t add_chunk(size_t size) {
+// beyond the requested size.  The chunk only takes blocks of the given hint.
+// Must hold mut, which is dropped while the chunk is mapped.
+size_t add_chunk(size_t size, erikmt_hint hint) {
     // Pad to ensure there's enough room for desired allocation + headers/footers structs
     size_t required_size = align_to_pagesize(sizeof(chunk_s)*2) + align_to_pagesize(get_padded_size(size));
 
@@ -121,156 +410,219 @@ size_t add_chunk(size_t size) {
 
     debug(std::cout, "Created chunk with size:", aligned_size, "bytes");
 
-    char *ptr = static_cast<char*>(mmap(NULL, aligned_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    char *ptr;
+    {
+        heap_unlock_s unlocked;
+        ptr = chunk_cache_map(aligned_size);
+    }
+    if (!ptr) {
+        return 0;
+    }
 
-    tag_chunk(ptr, aligned_size);
+    tag_chunk(ptr, aligned_size, hint);
 
     return aligned_size;
 }
 
-// Find free space in parent chunk, and reserve it
+// Carve a new segment out of the untouched space at the end of the chunk
 void* create_segment_in_chunk(chunk_s* chunk, size_t size) {
     debug(std::cout, "SIZE REMAINING:", chunk->remaining_size);
-    segment_s* segment_iter = chunk->next_segment;
 
-    // Update total remaining contiguous space removing allocation size + header/footer padding
-    // TODO: Align this?
-    chunk->remaining_size = chunk->remaining_size - get_padded_size(size);
-    chunk->total_allocations += 1;
-
-    // Skip to free space pool
-    // Find the pointer to the last segment before the free space begins
-    uintptr_t free_space_ptr;
-    if (segment_iter == nullptr) {
-        // No segments currently exist in this chunk, initialize with offset from chunk_s header
-        free_space_ptr = reinterpret_cast<uintptr_t>(chunk) + sizeof(chunk_s) + 1;
-    } else {
-        // Iterate to end of currently allocated space
-        while (segment_iter->next) {
-            segment_iter = segment_iter->next;
-        }
-        free_space_ptr = reinterpret_cast<uintptr_t>(segment_iter) + sizeof(segment_s) + 1;
-    }
-
-    // Now write a header and footer for the new segment
-    // Add footer to end of allocation
-    struct segment_s* footer = reinterpret_cast<segment_s*>(align_4(free_space_ptr + sizeof(segment_s) + size));
-    debug(std::cout, "Writing segment footer at address", footer);
-
-    footer->next = nullptr;
-    footer->size = size;
-    footer->is_allocated = true;
-    footer->is_footer = true;
+    size = align_segment(size);
 
-    struct segment_s* header = reinterpret_cast<segment_s*>(align_4(free_space_ptr));
-    debug(std::cout, "Writing segment header at address", header);
+    // The free space begins right after everything carved out so far
+    segment_s* header = write_segment(get_free_space(chunk), size, true);
+    debug(std::cout, "Writing segment header at address", header, "and footer at", get_footer(header));
 
-    header->next = footer;
-    header->size = size;
-    header->is_allocated = true;
-    header->is_footer = false;
-
-    if (chunk->next_segment == nullptr) {
-        chunk->next_segment = header;
-    } else {
-        segment_s* header_iter = chunk->next_segment;
-        while (header_iter->next) {
-            header_iter = header_iter->next;
-        }
-        header_iter->next = header;
-    }
-
-    debug(std::cout, "Header next is", header->next, "and footer next is", footer->next);
+    // Update total remaining contiguous space removing allocation size + header/footer padding
+    set_remaining_size(chunk, chunk->remaining_size - get_padded_size(size));
+    chunk->total_allocations += 1;
+    carving[chunk->hint] = chunk;
 
 #ifdef DEBUG
     print_memory_stack();
 #endif
 
-    debug(std::cout, "Returning ptr to", reinterpret_cast<void *>(align_4(free_space_ptr + sizeof(segment_s))));
-    return get_payload(free_space_ptr);
+    debug(std::cout, "Returning ptr to", get_payload(header));
+    return get_payload(header);
 }
 
-// Find free space in parent chunk (if it exists), reserve it,
-// and return a void* pointer to it.
+// Reserve a free segment for an allocation of size bytes.  If the segment is
+// large enough that the tail could hold another allocation, split the tail
+// off into a new free segment instead of handing out the whole thing.
 void* reserve_segment(chunk_s* parent_chunk, segment_s* segment, size_t size) {
     debug(std::cout, "Reusing segment:", segment, "in parent chunk:", parent_chunk,
       "with size:", segment->size, "for new segment of size:", size);
 
-    segment->size = size;
-    segment->is_allocated = true;
+    uint64_t released_at = get_released_at(segment);
+    bool purged = is_purged(segment);
+    unindex_segment(parent_chunk, segment);
+    // A free segment is always followed by an allocated one, nothing to merge
+    if (split_segment(segment, align_segment(size))) {
+        index_segment(parent_chunk, get_footer(segment) + 1, released_at, purged);
+    } else {
+        segment->is_allocated = true;
+        get_footer(segment)->is_allocated = true;
+    }
 
     parent_chunk->total_allocations += 1;
 #ifdef DEBUG
     print_memory_stack();
 #endif
 
-    debug(std::cout, "Returning reuse ptr to space at", reinterpret_cast<void *>((uintptr_t) segment  + sizeof(segment_s)));
+    debug(std::cout, "Returning reuse ptr to space at", get_payload(segment));
     // Already aligned
-    return reinterpret_cast<void *>((uintptr_t) segment + sizeof(segment_s));
+    return get_payload(segment);
 }
 
 // Find and return a void* pointer to a new memory segment to new()
-// The second call to find_segment() is guaranteed to return a segment if
-// add_chunk succeeds (as this is happening in a mutex that prevents anyone)
-// else from claiming it.  There's a little unnecessary overhead since we
-// walk the linked list from root to get there, so it makes sense to refactor
-// this later to have add_chunk also create the first segment and return the
-// pointer to it directly.
+// add_chunk() drops mut while it maps the new chunk, so other threads may
+// allocate, free or add chunks of their own in the meantime.  The second call
+// to find_segment() is still guaranteed to return a segment if add_chunk()
+// succeeds: the new chunk is only linked in and its free space indexed after
+// mut is taken back, first in its bin, and mut isn't dropped again before
+// find_segment() claims it.
+//
+// Must hold mut, unless the request is served from the slabs, which have
+// locks of their own (see lock_heap_for()).
 void *get_segment(size_t size) {
-    void *seg = find_segment(size);
+    return get_hinted_segment(size, ERIKMT_HINT_NONE);
+}
+
+// Same as get_segment(), from the slabs and chunks kept for hint
+void* get_hinted_segment(size_t size, erikmt_hint hint) {
+    // Small requests are served from size class slabs instead of segments
+    if (size <= SLAB_MAX_SIZE) {
+        return slab_alloc(size, hint);
+    }
+
+    drain_remote_frees();
+    // Huge requests get their own mapping, outside of the chunk list
+    if (size >= huge_threshold) {
+        return huge_alloc(size);
+    }
+
+    void *seg = find_segment(size, hint);
 
     if (seg == nullptr) {
         // Unable to find space to allocate a new segment, so add a new memory chunk
-        add_chunk(size);
+        add_chunk(size, hint);
     } else {
         return seg;
     }
 
-    return find_segment(size);
+    return find_segment(size, hint);
 }
 
-// Locate (or create) and return a viable segment, and return a void* to it.
-void *find_segment(size_t minimum_size) {
-#ifdef DEBUG
-    print_memory_stack();
-#endif
+// Allocate up to count blocks of size bytes in one go, must hold mut unless
+// they're slab sizes.  Slab classes hand out runs of adjacent slots, and
+// segments are carved one after the other from the untouched space of the
+// chunk the first one came from.  Returns how many were allocated.
+size_t get_segments(size_t size, size_t count, void** out) {
+    if (size <= SLAB_MAX_SIZE) {
+        return slab_alloc_batch(size, count, out);
+    }
 
-    debug(std::cout, "Searching for free segment..");
+    drain_remote_frees();
 
-    chunk_s* r = root;
-    chunk_s* parent_chunk;
-    
-    while (r) {
-        if (r->is_footer) {
-            r = r->next;
-            continue;
+    size_t n = 0;
+    while (n < count) {
+        void* ptr = get_segment(size);
+        if (!ptr) {
+            break;
         }
+        out[n++] = ptr;
 
-        debug(std::cout, "Checking CHUNK", r, "with size", r->allocated_size, "and remaining space", r->remaining_size,
-          "for minimum required size of", minimum_size);
-        parent_chunk = r;
-        segment_s* segment_iter = r->next_segment;
-
-        while (segment_iter) {
-            // Look for a free segment to reclaim while searching for free chunk space
-            // If we find it, re-use instead of allocating new segments
-            if (segment_iter->size >= minimum_size && segment_iter->is_allocated == false && segment_iter->is_footer == false) {
-                // Located an existing segment large enough for allocation and marked unallocated
-                debug(std::cout, "Found a reusable segment in chunk (need", minimum_size, "bytes, have", segment_iter->size, "bytes available.");
-                return reserve_segment(parent_chunk, segment_iter, minimum_size);
-            }
-            segment_iter = segment_iter->next;
+        if (size >= huge_threshold) {
+            continue;
         }
 
-        if (r->remaining_size >= minimum_size && r->is_footer == false) {
-            // Unable to find an unallocated segment, allocate a new segment in chunk
-            debug(std::cout, "Found a free MMAP chunk (need", minimum_size, "bytes, have", r->remaining_size, "bytes available.");
-            return create_segment_in_chunk(r, minimum_size);
-        } else {
-            debug(std::cout, "Skipping chunk", r, "- no space available");
+        chunk_s* chunk = pagemap_lookup(ptr);
+        while (n < count && chunk->remaining_size >= get_padded_size(size)) {
+            out[n++] = create_segment_in_chunk(chunk, size);
         }
+    }
 
-        r = r->next;
+    return n;
+}
+
+// Return a segment whose payload is aligned to alignment bytes (a power of
+// two).  Small requests use a slab class with naturally aligned slots.
+// Otherwise a segment with room for the alignment is reserved, and the gap
+// in front of the aligned payload and any slack behind it are handed back
+// as free segments.
+void* get_aligned_segment(size_t size, size_t alignment) {
+    if (alignment <= MIN_ALIGNMENT) {
+        return get_segment(size);
+    }
+    if (alignment <= SLAB_SLOT_ALIGNMENT && size <= SLAB_MAX_SIZE) {
+        return get_segment(aligned_class_size(size, alignment));
+    }
+
+    size_t padded_size = size + alignment + get_padded_size(0);
+    if (padded_size >= huge_threshold) {
+        return huge_alloc(size, alignment);
+    }
+
+    // Stay clear of the slabs, the slack has to be carved out of a segment
+    void* ptr = get_segment((padded_size > SLAB_MAX_SIZE) ? padded_size : SLAB_MAX_SIZE + 1);
+    if (!ptr) {
+        return nullptr;
+    }
+
+    chunk_s* chunk = pagemap_lookup(ptr);
+    segment_s* header = static_cast<segment_s*>(get_header(ptr));
+    uintptr_t payload = reinterpret_cast<uintptr_t>(ptr);
+
+    if (payload % alignment) {
+        // The gap must fit a header/footer pair of its own
+        uintptr_t aligned = (payload + get_padded_size(0) + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+        size_t gap = aligned - payload;
+
+        segment_s* aligned_header = write_segment(reinterpret_cast<char*>(aligned) - sizeof(segment_s),
+            header->size - gap, true);
+        write_segment(reinterpret_cast<char*>(header), gap - get_padded_size(0), false);
+
+        debug(std::cout, "Aligned segment", header, "to", aligned_header, "for alignment", alignment);
+        coalesce_segment(chunk, header);
+        header = aligned_header;
+    }
+
+    if (split_segment(header, align_segment(size))) {
+        coalesce_segment(chunk, get_footer(header) + 1);
+    }
+
+    return get_payload(header);
+}
+
+// Locate (or create) and return a viable segment, and return a void* to it.
+// A free segment of the best fitting size is reused first, then the chunk
+// whose untouched space fits the request most closely is carved from.  Both
+// are found in constant time through the free indexes of the hint.
+void *find_segment(size_t minimum_size, erikmt_hint hint) {
+#ifdef DEBUG
+    print_memory_stack();
+#endif
+
+    debug(std::cout, "Searching for free segment..");
+
+    free_node_s* node = free_index_find(&free_segments[hint], align_segment(minimum_size));
+    if (node) {
+        segment_s* segment = get_segment_from_node(node);
+        debug(std::cout, "Found a reusable segment (need", minimum_size, "bytes, have", segment->size, "bytes available.");
+        return reserve_segment(pagemap_lookup(node), segment, minimum_size);
+    }
+
+    // Compare against the padded size, which is what create_segment_in_chunk() consumes
+    size_t padded_size = get_padded_size(minimum_size);
+    chunk_s* chunk = carving[hint];
+    if (!chunk || chunk->remaining_size < padded_size) {
+        node = free_index_find(&free_spaces[hint], padded_size);
+        chunk = node ? reinterpret_cast<chunk_s*>(reinterpret_cast<char*>(node) - offsetof(chunk_s, free_space_node)) : nullptr;
+    }
+    if (chunk) {
+        debug(std::cout, "Found a free MMAP chunk (need", minimum_size, "bytes, have", chunk->remaining_size, "bytes available.");
+        return create_segment_in_chunk(chunk, minimum_size);
     }
 
     debug(std::cout, "No suitable segments available, need to allocate one.");
@@ -278,119 +630,217 @@ void *find_segment(size_t minimum_size) {
     return nullptr;
 }
 
+// Remove a chunk from the chunk list.  The list alternates chunk headers and
+// footers, so the chunk's footer points at the next chunk's header.
 void unlink_node(chunk_s* root_node, chunk_s* node_to_remove) {
-    chunk_s* current_node = root_node;
-    if (current_node == node_to_remove) {
-        while (current_node->next != nullptr) {
-            if (current_node->next->is_parent && current_node->next->is_footer && current_node->next->next == nullptr) {
-                // This is the only node
-                root = nullptr;
-                cur = nullptr;
-            }
-            current_node = current_node->next;
+    chunk_s* next_header = node_to_remove->next->next;
+
+    if (root_node == node_to_remove) {
+        root = next_header;
+        cur = next_header;
+        if (!next_header) {
+            tail = nullptr;
         }
-    } else {
-        while (current_node->next != nullptr) {
-            if (current_node->next == node_to_remove) {
-               chunk_s* current_footer = current_node;
-               // Now that we have the footer pointing to the chunk to remove, we need to
-               // re-point the footer that points to it to the next chunk header in the list
-               current_node = current_node->next;
-
-               while (current_node->next != nullptr) {
-                  if (current_node->next->is_parent && !(current_node->next->is_footer)) {
-                     // Found the next parent header
-                     current_footer->next = current_node->next;
-                     return;
-                  }
-                  // If we made it here, this was the last node in the list
-                  current_footer->next = nullptr;
-                  return;
-               }
+        return;
+    }
+
+    for (chunk_s* node = root_node; node; node = node->next) {
+        if (node->next == node_to_remove) {
+            node->next = next_header;
+            if (!next_header) {
+                tail = node;
             }
-            current_node = current_node->next;
+            return;
         }
     }
 }
 
+// Mark a segment free and merge it with free neighbours on either side, found
+// through the boundary tags.  A free segment left at the very end of the chunk
+// is handed back to the chunk's untouched space, any other is indexed.  header
+// must not be indexed yet.
+static void coalesce_segment(chunk_s* chunk, segment_s* header) {
+    segment_s* footer = get_footer(header);
+    segment_s* next = get_next_segment(chunk, header);
+
+    if (next && !next->is_allocated) {
+        debug(std::cout, "Coalescing with next free segment", next);
+        unindex_segment(chunk, next);
+        footer = get_footer(next);
+    }
+
+    segment_s* prev_footer = get_prev_footer(chunk, header);
+    if (prev_footer && !prev_footer->is_allocated) {
+        header = get_header_from_footer(prev_footer);
+        debug(std::cout, "Coalescing with previous free segment", header);
+        unindex_segment(chunk, header);
+    }
+
+    size_t size = reinterpret_cast<char*>(footer) - static_cast<char*>(get_payload(header));
+    write_segment(reinterpret_cast<char*>(header), size, false);
+
+    // Whatever was merged in counts as released now
+    if (reinterpret_cast<char*>(footer + 1) == get_free_space(chunk)) {
+        debug(std::cout, "Returning trailing free segment", header, "to chunk free space");
+        chunk->free_space_node.released_at = now_ms();
+        chunk->free_space_node.purged = false;
+        set_remaining_size(chunk, chunk->remaining_size + get_padded_size(size));
+    } else {
+        index_segment(chunk, header, now_ms(), false);
+    }
+}
+
+// Release the segment owning ptr.  The page map resolves ptr to its chunk, and
+// the segment header sits directly in front of the payload, so this no longer
+// depends on the number of chunks or live segments.  Must hold mut, unless
+// ptr is a slab slot.  A chunk this empties may evict another from the chunk
+// cache, which the caller unmaps with chunk_cache_release_evicted() once it
+// has dropped mut.
 void free_segment(void* ptr) {
-    void* parent_struct = get_header(ptr);
+    chunk_s* chunk = pagemap_lookup(ptr);
 
-    debug(std::cout, "In free_segment() for ptr: ", ptr, "struct ptr is: ", parent_struct);
+    if (!chunk) {
+        debug(std::cout, "Ignoring free of unknown ptr", ptr);
+        return;
+    }
 
-    chunk_s* r = root;
-    chunk_s* current_parent_node;
+    if (chunk->is_slab) {
+        std::unique_lock<std::mutex> class_lock(slab_lock(chunk));
+        slab_free(chunk, ptr);
+        return;
+    }
+    if (chunk->is_huge) {
+        huge_free(chunk);
+        return;
+    }
 
-    while (r) {
-        // Check that pointer address that we're freeing is in the range of allocated
-        // space for this chunk.  If it's not, don't bother descending into this chunks
-        // segments, move to next chunk.
-        if (!(r < ptr && (r + r->allocated_size) > ptr)) {
-            debug(std::cout, "Skipping chunk", r, "in free for ptr address", ptr);
-            r = r->next;
-            continue;
-        }
+    segment_s* segment = static_cast<segment_s*>(get_header(ptr));
+
+    debug(std::cout, "In free_segment() for ptr: ", ptr, "struct ptr is: ", segment);
 
-        current_parent_node = r;
-        segment_s* segment_iter = r->next_segment;
+    if (reinterpret_cast<char*>(segment) < get_segment_area(chunk) ||
+        segment->is_footer || !segment->is_allocated) {
+        debug(std::cout, "Ignoring free of invalid segment ptr", ptr);
+        return;
+    }
+
+    debug(std::cout, "Located segment to free at", segment->size);
+    chunk->total_allocations -= 1;
+
+    // Freeing the last segment merges everything back into the free space,
+    // taking the chunk's free segments out of the index
+    coalesce_segment(chunk, segment);
+
+    if (chunk->total_allocations == 0) {
+        // allocated_size excludes the page reserved for the chunk header/footer
+        size_t mapped_size = chunk->allocated_size + get_pagesize();
+
+        debug(std::cout, "No remaining allocated segments in chunk, releasing chunk space");
+        unindex_free_space(chunk);
+        if (carving[chunk->hint] == chunk) {
+            carving[chunk->hint] = nullptr;
+        }
+        unlink_node(root, chunk);
+        pagemap_unregister(chunk, mapped_size);
+        chunk_cache_unmap(reinterpret_cast<char*>(chunk), mapped_size);
+    }
+}
 
-        while (segment_iter) {
-            if (segment_iter == parent_struct) {
-                debug(std::cout, "Located segment to free at", segment_iter->size);
-                segment_iter->is_allocated = false;
-                current_parent_node->total_allocations -= 1;
+// Purge every block of index released before cutoff and not purged since.
+// Segments keep the free_node_s at their start resident, the untouched space
+// of a chunk keeps its node in the chunk header.
+static void purge_index(free_index_s* index, uint64_t cutoff, bool is_free_space) {
+    for (uint64_t fl_map = index->first_level; fl_map; fl_map &= fl_map - 1) {
+        unsigned int fl = __builtin_ctzll(fl_map);
+        for (uint32_t sl_map = index->second_level[fl]; sl_map; sl_map &= sl_map - 1) {
+            for (free_node_s* node = index->bins[fl][__builtin_ctz(sl_map)]; node; node = node->next) {
+                if (node->purged || node->released_at > cutoff) {
+                    continue;
+                }
 
-                if (current_parent_node->total_allocations == 0) {
-                    debug(std::cout, "No remaining allocated segments in chunk, munmap()ing chunk space");
-                    unlink_node(root, current_parent_node);
-                    munmap(current_parent_node, current_parent_node->allocated_size);
+                if (is_free_space) {
+                    chunk_s* chunk = reinterpret_cast<chunk_s*>(reinterpret_cast<char*>(node) - offsetof(chunk_s, free_space_node));
+                    purge_pages(get_free_space(chunk), node->size, true);
+                } else {
+                    purge_pages(node + 1, node->size - sizeof(free_node_s), true);
                 }
-                return;
+                node->purged = true;
             }
-            segment_iter = segment_iter->next;
         }
+    }
+}
+
+// Purge the pages of free segments and of the untouched space at the end of
+// live chunks that have been idle since before cutoff, must hold mut.  Only
+// the free blocks are visited, and each is purged once until it's reused or
+// merged with a neighbour.  The chunk footer's page stays resident.
+void purge_free_space(uint64_t cutoff) {
+    for (int hint = 0; hint < ERIKMT_HINT_COUNT; ++hint) {
+        purge_index(&free_segments[hint], cutoff, false);
+        purge_index(&free_spaces[hint], cutoff, true);
+    }
+}
 
-        r = r->next;
+static void print_chunk(chunk_s* r) {
+    std::cout << std::boolalpha
+        << "SEGMENT: " << r
+        << " ALLOCATED SIZE: " << r->allocated_size
+        << " REMAINING SIZE: " << r->remaining_size
+        << " IS_ALLOCATED: " << r->is_allocated
+        << " TOTAL_ALLOCATIONS: " << r->total_allocations
+        << " IS_PARENT: " << r->is_parent
+        << " IS_SLAB: " << r->is_slab
+        << " IS_HUGE: " << r->is_huge
+        << " HINT: " << static_cast<int>(r->hint)
+        << std::endl;
+
+    if (r->is_slab) {
+        print_slab(r);
+        return;
+    }
+
+    for (segment_s* segment_iter = get_first_segment(r); segment_iter; segment_iter = get_next_segment(r, segment_iter)) {
+        std::cout << std::boolalpha
+            << "SEGMENT: " << segment_iter
+            << " SIZE: " << segment_iter->size
+            << " IS_ALLOCATED: " << static_cast<bool>(segment_iter->is_allocated)
+            << " FOOTER: " << get_footer(segment_iter)
+            << std::endl;
     }
 }
 
+// Push a chain of freed blocks, linked through their first word and ending
+// at last, onto the remote free list.  Never blocks.
+void push_remote_frees(void* first, void* last) {
+    void* head = remote_frees.load(std::memory_order_relaxed);
+
+    do {
+        *static_cast<void**>(last) = head;
+    } while (!remote_frees.compare_exchange_weak(head, first, std::memory_order_release, std::memory_order_relaxed));
+}
+
+// Free every block pushed onto the remote free list so far, must hold mut
+void drain_remote_frees() {
+    if (!remote_frees.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    void* ptr = remote_frees.exchange(nullptr, std::memory_order_acquire);
+    while (ptr) {
+        void* next = *static_cast<void**>(ptr);
+        free_segment(ptr);
+        ptr = next;
+    }
+}
+
+// Walk every chunk (segment and slab alike) through the page map.  Must hold mut.
 void print_memory_stack() {
     std::cout << "" << std::endl;
     std::cout << "MEMORY ALLOCATOR STACK" << std::endl;
     std::cout << "-------------------------------------" << std::endl;
 
-    chunk_s* r = root;
-
-    if (r) std::cout << r << std::endl;
+    pagemap_for_each_chunk(print_chunk);
 
-    while (r) {
-        std::cout << std::boolalpha
-            << "SEGMENT: " << r
-            << " ALLOCATED SIZE: " << r->allocated_size
-            << " REMAINING SIZE: " << r->remaining_size
-            << " IS_ALLOCATED: " << r->is_allocated
-            << " TOTAL_ALLOCATIONS: " << r->total_allocations
-            << " IS_PARENT: " << r->is_parent
-            << " IS FOOTER: " << r->is_footer
-            << " NEXT: " << r->next
-            << std::endl;
-        
-        segment_s* segment_iter = r->next_segment;
-
-        while (segment_iter) {
-            std::cout << std::boolalpha
-                << "SEGMENT: " << segment_iter
-                << " SIZE: " << segment_iter->size
-                << " IS_ALLOCATED: " << segment_iter->is_allocated
-                << " IS FOOTER: " << segment_iter->is_footer
-                << " NEXT: " << segment_iter->next
-                << std::endl;
-
-            segment_iter = segment_iter->next;
-        }
-
-        r = r->next;
-    }
     std::cout << "-------------------------------------------------------" << std::endl;
     std::cout << "" << std::endl;
-}
\ No newline at end of file
+}
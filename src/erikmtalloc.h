@@ -1,5 +1,62 @@
+#pragma once
+
+// Expected lifetime of an allocation, see erikmt_alloc_hint()
+enum erikmt_hint {
+    ERIKMT_HINT_NONE,        // Same as malloc()
+    ERIKMT_HINT_SHORT_LIVED, // Freed again soon, e.g. at the end of a request
+    ERIKMT_HINT_LONG_LIVED,  // Kept for most of the program's run
+    ERIKMT_HINT_COLD,        // Rarely touched once written
+};
+
+#define ERIKMT_HINT_COUNT 4
+
 void print_memory_stack();
 void* get_segment(size_t size);
+void* get_hinted_segment(size_t size, erikmt_hint hint);
+size_t get_segments(size_t size, size_t count, void** out);
+void* get_aligned_segment(size_t size, size_t alignment);
 void* add_segment(size_t size);
-void* find_segment(size_t minimum_size);
-void free_segment(void* ptr);
\ No newline at end of file
+void* find_segment(size_t minimum_size, erikmt_hint hint);
+void free_segment(void* ptr);
+void push_remote_frees(void* first, void* last);
+void drain_remote_frees();
+size_t get_segment_size(void* ptr);
+void* resize_segment(void* ptr, size_t size);
+void set_huge_threshold(size_t size);
+bool expand_segment(void* ptr, size_t size);
+bool shrink_segment(void* ptr, size_t size);
+void set_decay_time(long milliseconds);
+void purge_memory();
+bool start_purge_thread();
+
+// C allocation API, exported as malloc() and friends by liberikmtalloc.so
+void* erikmt_malloc(size_t size);
+void erikmt_free(void* ptr);
+void* erikmt_calloc(size_t count, size_t size);
+void* erikmt_realloc(void* ptr, size_t size);
+int erikmt_posix_memalign(void** out, size_t alignment, size_t size);
+void* erikmt_aligned_alloc(size_t alignment, size_t size);
+size_t erikmt_malloc_usable_size(void* ptr);
+
+// Resize an allocation without moving it.  A block resized this way must be
+// freed with free(), erikmt_free() or an unsized delete, since its size no
+// longer matches the one it was allocated with.
+bool erikmt_try_expand(void* ptr, size_t size);
+bool erikmt_shrink(void* ptr, size_t size);
+size_t erikmt_usable_size(void* ptr);
+
+// Allocate or free many blocks with a single lock acquisition
+size_t erikmt_alloc_batch(size_t size, size_t count, void** out);
+void erikmt_free_batch(void** ptrs, size_t count);
+
+// Allocate from chunks reserved for blocks with the same expected lifetime,
+// so that chunks full of short lived blocks empty out and are released,
+// while long lived and cold blocks stay packed together.  Hinted blocks
+// bypass the caches, and are freed with free() or delete as usual.
+void* erikmt_alloc_hint(size_t size, erikmt_hint hint);
+
+// Placement form of the same, e.g. new (ERIKMT_HINT_LONG_LIVED) T(...)
+void* operator new(size_t size, erikmt_hint hint);
+void* operator new[](size_t size, erikmt_hint hint);
+void operator delete(void* ptr, erikmt_hint hint) noexcept;
+void operator delete[](void* ptr, erikmt_hint hint) noexcept;
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "free_index.h"
+
+#define DEFAULT_CHUNK_SIZE 1024*256 // 256KB chunks
+#define SEGMENT_MIN_SPLIT 64 // Smallest free tail worth splitting off a reused segment
+
+// Boundary tag written right in front of and right behind every segment's
+// payload, packed into 8 bytes.  A header at an address 8 bytes short of a 16
+// byte boundary keeps the payload 16 byte aligned, as malloc() is expected to
+// return, and its footer in turn ends where the next segment's header begins.
+struct segment_s {
+    uint64_t size : 48; // Payload bytes, a multiple of MIN_ALIGNMENT
+    uint64_t is_allocated : 1;
+    uint64_t is_footer : 1;
+    uint64_t unused : 14;
+};
+
+static_assert(sizeof(segment_s) == 8, "segment tags are packed into 8 bytes");
+
+// mmap()'ed parent "chunks", on which variable size "segments" are allocated
+struct chunk_s {
+    chunk_s* next;
+    size_t allocated_size;
+    size_t remaining_size;
+    bool is_allocated;
+    bool is_footer;
+    bool is_parent;
+    bool is_slab; // Chunk is carved into fixed size slab slots instead of segments
+    bool is_huge; // Chunk is a dedicated mapping for a single huge allocation
+    uint8_t hint; // erikmt_hint shared by every block carved from the chunk
+    int total_allocations = 0;
+    free_node_s free_space_node; // Indexes the untouched space of segment chunks by remaining_size
+};
+
+typedef struct chunk_s chunk_s;
+typedef struct segment_s segment_s;
+
+size_t get_pagesize();
+
+size_t align_to_pagesize(size_t size);
+char* map_chunk(size_t aligned_size);
+void purge_free_space(uint64_t cutoff);
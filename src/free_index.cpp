@@ -0,0 +1,89 @@
+#include <cstddef>
+#include <cstdint>
+
+#include "free_index.h"
+
+// First level: the power of two range size falls in.  Second level: which of
+// the FREE_INDEX_SL_COUNT equal slices of that range.
+static void map_size(size_t size, unsigned int* fl, unsigned int* sl) {
+    *fl = 63 - __builtin_clzll(size);
+    *sl = (size >> (*fl - FREE_INDEX_SL_BITS)) & (FREE_INDEX_SL_COUNT - 1);
+}
+
+void free_index_insert(free_index_s* index, free_node_s* node, size_t size) {
+    unsigned int fl, sl;
+    map_size(size, &fl, &sl);
+
+    node->size = size;
+    node->prev = nullptr;
+    node->next = index->bins[fl][sl];
+    if (node->next) {
+        node->next->prev = node;
+    }
+    index->bins[fl][sl] = node;
+
+    index->first_level |= 1ULL << fl;
+    index->second_level[fl] |= 1U << sl;
+}
+
+void free_index_remove(free_index_s* index, free_node_s* node) {
+    unsigned int fl, sl;
+    map_size(node->size, &fl, &sl);
+
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        index->bins[fl][sl] = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    }
+
+    if (!index->bins[fl][sl]) {
+        index->second_level[fl] &= ~(1U << sl);
+        if (!index->second_level[fl]) {
+            index->first_level &= ~(1ULL << fl);
+        }
+    }
+}
+
+// Return a free block of at least size bytes, or nullptr if there's none.
+// The request's own bin also holds blocks smaller than size, so only the
+// first FREE_INDEX_SCAN_LIMIT blocks in it are tried, keeping the smallest
+// that fits.  Failing that, any block in the next non-empty bin up fits, and
+// is at most 1/FREE_INDEX_SL_COUNT larger than needed unless that bin is far
+// above the request.
+free_node_s* free_index_find(free_index_s* index, size_t size) {
+    if (size < FREE_INDEX_MIN_SIZE) {
+        size = FREE_INDEX_MIN_SIZE;
+    }
+
+    unsigned int fl, sl;
+    map_size(size, &fl, &sl);
+
+    free_node_s* best = nullptr;
+    unsigned int scanned = 0;
+    for (free_node_s* node = index->bins[fl][sl]; node && scanned < FREE_INDEX_SCAN_LIMIT; node = node->next, ++scanned) {
+        if (node->size == size) {
+            return node;
+        }
+        if (node->size > size && (!best || node->size < best->size)) {
+            best = node;
+        }
+    }
+    if (best) {
+        return best;
+    }
+
+    uint32_t sl_map = index->second_level[fl] & (~0U << (sl + 1));
+    if (!sl_map) {
+        uint64_t fl_map = (fl + 1 < FREE_INDEX_FL_COUNT) ? index->first_level & (~0ULL << (fl + 1)) : 0;
+        if (!fl_map) {
+            return nullptr;
+        }
+        fl = __builtin_ctzll(fl_map);
+        sl_map = index->second_level[fl];
+    }
+
+    return index->bins[fl][__builtin_ctz(sl_map)];
+}
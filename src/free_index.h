@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#define FREE_INDEX_SL_BITS 4 // Every power of two size range is split into 16 bins
+#define FREE_INDEX_SL_COUNT (1 << FREE_INDEX_SL_BITS)
+#define FREE_INDEX_FL_COUNT 64 // One power of two range per bit of size_t
+#define FREE_INDEX_MIN_SIZE 48 // Smaller free blocks are too small to hold a free_node_s, and stay unindexed
+#define FREE_INDEX_SCAN_LIMIT 8 // Blocks looked at in the request's own bin before moving up a bin
+
+// Links of a free block in a free_index_s, stored inside the free block itself.
+// The index leaves released_at and purged to the owner of the block.
+struct free_node_s {
+    free_node_s* prev;
+    free_node_s* next;
+    size_t size;
+    uint64_t released_at; // Milliseconds on the monotonic clock
+    bool purged; // The block's pages were handed back since released_at
+};
+
+// Two level segregated fit index of free blocks (as in TLSF): the first level
+// picks the power of two range of a size, the second level one of
+// FREE_INDEX_SL_COUNT linear bins within it.  A bitmap per level records the
+// non-empty bins, so finding the smallest non-empty bin that fits a request
+// takes two bit scans, however many blocks are free.  Not thread safe.
+struct free_index_s {
+    uint64_t first_level;
+    uint16_t second_level[FREE_INDEX_FL_COUNT];
+    free_node_s* bins[FREE_INDEX_FL_COUNT][FREE_INDEX_SL_COUNT];
+};
+
+typedef struct free_node_s free_node_s;
+typedef struct free_index_s free_index_s;
+
+void free_index_insert(free_index_s* index, free_node_s* node, size_t size);
+void free_index_remove(free_index_s* index, free_node_s* node);
+free_node_s* free_index_find(free_index_s* index, size_t size);
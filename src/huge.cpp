@@ -0,0 +1,234 @@
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <sys/mman.h>
+
+#include "erikmtalloc.h"
+#include "erikmtalloc_internal.h"
+#include "huge.h"
+#include "pagemap.h"
+#include "stats.h"
+#include "trace.h"
+#include "utils.h"
+
+// A huge allocation is a mapping of its own: a huge_s header followed by
+// the payload.  Huge allocations are kept on their own list, so they never
+// show up in the chunk/segment searches, and are resolved on free through
+// the page map like any other chunk.  The list has its own lock, and the
+// mmap()/munmap() calls happen outside of it.  The payload normally starts
+// right after the header, or further in if a larger alignment was requested.
+struct huge_s {
+    chunk_s chunk;
+    huge_s* prev;
+    huge_s* next;
+    size_t payload_offset;
+};
+
+typedef struct huge_s huge_s;
+
+static_assert(sizeof(huge_s) <= HUGE_HEADER_SIZE, "huge_s must fit in HUGE_HEADER_SIZE");
+
+size_t huge_threshold = HUGE_THRESHOLD;
+
+// Guards huge_list.  Taken after mut, and never together with the slab or
+// chunk cache locks.
+static std::mutex huge_mut;
+static huge_s* huge_list;
+
+// Round up to a whole number of pages (unlike align_to_pagesize(), an
+// already aligned size is left alone so mremap() doesn't grow needlessly)
+static size_t round_to_pages(size_t size) {
+    return (size + get_pagesize() - 1) & ~(get_pagesize() - 1);
+}
+
+// Whether size bytes plus overhead bytes still fit a page rounded mapping,
+// instead of wrapping around to a small one
+static bool fits_mapping(size_t size, size_t overhead) {
+    return size <= SIZE_MAX - overhead - get_pagesize();
+}
+
+static void* get_huge_payload(huge_s* huge) {
+    return reinterpret_cast<char*>(huge) + huge->payload_offset;
+}
+
+// Must hold huge_mut
+static void link_huge(huge_s* huge) {
+    huge->prev = nullptr;
+    huge->next = huge_list;
+    if (huge_list) {
+        huge_list->prev = huge;
+    }
+    huge_list = huge;
+}
+
+// Must hold huge_mut
+static void unlink_huge(huge_s* huge) {
+    if (huge->prev) {
+        huge->prev->next = huge->next;
+    } else {
+        huge_list = huge->next;
+    }
+    if (huge->next) {
+        huge->next->prev = huge->prev;
+    }
+}
+
+// mmap() a dedicated, page aligned region for a single allocation whose
+// payload is aligned to alignment bytes (a power of two)
+void* huge_alloc(size_t size, size_t alignment) {
+    // Mappings are page aligned, so only larger alignments need slack
+    size_t slack = (alignment > get_pagesize()) ? alignment : 0;
+    if (slack > SIZE_MAX - HUGE_HEADER_SIZE || !fits_mapping(size, HUGE_HEADER_SIZE + slack)) {
+        debug(std::cout, "Huge allocation of size:", size, "bytes overflows a mapping");
+        return nullptr;
+    }
+    size_t mapped_size = round_to_pages(size + HUGE_HEADER_SIZE + slack);
+    char* ptr = map_chunk(mapped_size);
+    if (!ptr) {
+        return nullptr;
+    }
+
+    uintptr_t payload = reinterpret_cast<uintptr_t>(ptr) + HUGE_HEADER_SIZE;
+    payload = (payload + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+
+    debug(std::cout, "Created huge mapping at", static_cast<void*>(ptr), "with size:", mapped_size, "bytes");
+
+    huge_s* huge = reinterpret_cast<huge_s*>(ptr);
+    huge->chunk.next = nullptr;
+    huge->chunk.allocated_size = mapped_size;
+    huge->chunk.remaining_size = 0;
+    huge->chunk.is_allocated = true;
+    huge->chunk.is_footer = false;
+    huge->chunk.is_parent = true;
+    huge->chunk.is_slab = false;
+    huge->chunk.is_huge = true;
+    huge->chunk.hint = ERIKMT_HINT_NONE;
+    huge->chunk.total_allocations = 1;
+    huge->payload_offset = payload - reinterpret_cast<uintptr_t>(ptr);
+
+    pagemap_register(huge, mapped_size, &huge->chunk);
+
+    std::unique_lock<std::mutex> huge_lock(huge_mut);
+    link_huge(huge);
+
+    return get_huge_payload(huge);
+}
+
+// Unlink a huge allocation and hand its mapping straight back to the kernel
+void huge_free(chunk_s* chunk) {
+    huge_s* huge = reinterpret_cast<huge_s*>(chunk);
+    size_t mapped_size = chunk->allocated_size;
+
+    debug(std::cout, "munmap()ing huge mapping at", huge, "with size:", mapped_size, "bytes");
+
+    {
+        std::unique_lock<std::mutex> huge_lock(huge_mut);
+        unlink_huge(huge);
+    }
+
+    pagemap_unregister(huge, mapped_size);
+    munmap(huge, mapped_size);
+    stats_record_unmap(mapped_size);
+    trace(TRACE_MUNMAP, huge, mapped_size);
+}
+
+// Resize a huge allocation without moving it.  Shrinking always succeeds,
+// growing only if the address space right behind the mapping is free.
+// Returns false, leaving the allocation untouched, if it can't grow.
+bool huge_resize_in_place(chunk_s* chunk, size_t size) {
+    huge_s* huge = reinterpret_cast<huge_s*>(chunk);
+    if (!fits_mapping(size, huge->payload_offset)) {
+        return false;
+    }
+    size_t old_size = chunk->allocated_size;
+    size_t new_size = round_to_pages(size + huge->payload_offset);
+
+    if (new_size == old_size) {
+        return true;
+    }
+
+    std::unique_lock<std::mutex> huge_lock(huge_mut);
+
+    if (new_size < old_size) {
+        // Clear the tail first, another thread may map it once it's released
+        pagemap_unregister(reinterpret_cast<char*>(huge) + new_size, old_size - new_size);
+        mremap(huge, old_size, new_size, 0);
+    } else if (mremap(huge, old_size, new_size, 0) == MAP_FAILED) {
+        debug(std::cout, "No room to grow huge mapping", huge, "in place to size:", new_size, "bytes");
+        return false;
+    } else {
+        pagemap_register(reinterpret_cast<char*>(huge) + old_size, new_size - old_size, chunk);
+    }
+
+    // Resizing counts as freeing the old size and allocating the new one
+    stats_record_free(huge_usable_size(chunk));
+    stats_record_remap(old_size, new_size);
+    trace(TRACE_MREMAP, huge, new_size);
+    chunk->allocated_size = new_size;
+    stats_record_alloc(huge_usable_size(chunk));
+
+    return true;
+}
+
+// Resize a huge allocation with mremap(), which shrinks or grows the mapping
+// in place when the address space allows and otherwise moves the pages
+// without copying them.  Alignments above the page size aren't preserved if
+// the pages move.  Returns the (possibly moved) payload, or nullptr if
+// the kernel refused, in which case the allocation is left untouched.
+void* huge_realloc(chunk_s* chunk, size_t size) {
+    huge_s* huge = reinterpret_cast<huge_s*>(chunk);
+    if (!fits_mapping(size, huge->payload_offset)) {
+        return nullptr;
+    }
+    size_t old_size = chunk->allocated_size;
+    size_t new_size = round_to_pages(size + huge->payload_offset);
+
+    if (new_size <= old_size) {
+        huge_resize_in_place(chunk, size);
+        return get_huge_payload(huge);
+    }
+
+    std::unique_lock<std::mutex> huge_lock(huge_mut);
+    // Resizing counts as freeing the old size and allocating the new one
+    stats_record_free(huge_usable_size(chunk));
+
+    // The old range may be unmapped if the pages move, so drop it from the
+    // page map before it can be reused by anyone else
+    unlink_huge(huge);
+    pagemap_unregister(huge, old_size);
+
+    void* ptr = mremap(huge, old_size, new_size, MREMAP_MAYMOVE);
+    if (ptr == MAP_FAILED) {
+        debug(std::cout, "mremap() failed for huge mapping", huge, "to size:", new_size, "bytes");
+        pagemap_register(huge, old_size, chunk);
+        link_huge(huge);
+        stats_record_alloc(huge_usable_size(chunk));
+        return nullptr;
+    }
+
+    debug(std::cout, "Remapped huge mapping", huge, "to", ptr, "with size:", new_size, "bytes");
+
+    stats_record_remap(old_size, new_size);
+    trace(TRACE_MREMAP, ptr, new_size);
+    huge = static_cast<huge_s*>(ptr);
+    huge->chunk.allocated_size = new_size;
+    pagemap_register(huge, new_size, &huge->chunk);
+    link_huge(huge);
+    stats_record_alloc(huge_usable_size(&huge->chunk));
+
+    return get_huge_payload(huge);
+}
+
+size_t huge_usable_size(chunk_s* chunk) {
+    return chunk->allocated_size - reinterpret_cast<huge_s*>(chunk)->payload_offset;
+}
+
+// Hold the huge allocation list lock across fork(), it's held around mremap()
+void huge_lock_all() {
+    huge_mut.lock();
+}
+
+void huge_unlock_all() {
+    huge_mut.unlock();
+}
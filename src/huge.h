@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+
+#include "erikmtalloc_internal.h"
+
+#define HUGE_THRESHOLD 1024*128 // Requests of 128KB and up get their own mapping
+#define HUGE_HEADER_SIZE 128    // Header in front of the payload, keeps it cache line aligned
+
+extern size_t huge_threshold;
+
+void* huge_alloc(size_t size, size_t alignment = HUGE_HEADER_SIZE);
+void huge_free(chunk_s* chunk);
+void* huge_realloc(chunk_s* chunk, size_t size);
+bool huge_resize_in_place(chunk_s* chunk, size_t size);
+size_t huge_usable_size(chunk_s* chunk);
+void huge_lock_all();
+void huge_unlock_all();
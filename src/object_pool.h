@@ -0,0 +1,215 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+
+#include "chunk_cache.h"
+#include "size_classes.h"
+#include "thread_cache.h"
+
+#define OBJECT_POOL_CHUNK_SIZE 1024*64 // Chunks are multiples of 64KB, a whole number of pages
+#define OBJECT_POOL_MIN_SLOTS 64 // Chunks grow past OBJECT_POOL_CHUNK_SIZE to hold this many objects
+
+// Header at the start of every chunk mapped by an object pool
+struct object_pool_chunk_s {
+    object_pool_chunk_s* next;
+};
+
+typedef struct object_pool_chunk_s object_pool_chunk_s;
+
+// Map and unmap pool chunks through the chunk cache
+inline char* object_pool_map(size_t size) {
+    return chunk_cache_map(size);
+}
+
+inline void object_pool_unmap(void* chunk, size_t size) {
+    chunk_cache_unmap(static_cast<char*>(chunk), size);
+    chunk_cache_release_evicted();
+}
+
+// Fixed size pool for objects of type T, laid out at compile time: slots of
+// slot_size bytes aligned to slot_alignment are carved from mmap()ed chunks
+// of chunk_size bytes, and freed slots are linked through their first word.
+// Allocating is a free list pop or a bump of the chunk cursor, neither of
+// which touches the heap.  A pool is not thread safe.  A pool of your own
+// unmaps all of its chunks when destroyed, without running destructors.  A
+// thread_pool() never unmaps: when its thread exits, it pushes its slots onto
+// the orphan list for other thread pools of T to adopt.
+template <typename T>
+class erikmt_object_pool {
+public:
+    static constexpr size_t slot_alignment = (alignof(T) > alignof(void*)) ? alignof(T) : alignof(void*);
+    static constexpr size_t slot_size = ((sizeof(T) > sizeof(void*) ? sizeof(T) : sizeof(void*)) + slot_alignment - 1) & ~(slot_alignment - 1);
+    static constexpr size_t first_slot = (sizeof(object_pool_chunk_s) + slot_alignment - 1) & ~(slot_alignment - 1);
+    static constexpr size_t chunk_size = (first_slot + slot_size * OBJECT_POOL_MIN_SLOTS + OBJECT_POOL_CHUNK_SIZE - 1) / OBJECT_POOL_CHUNK_SIZE * OBJECT_POOL_CHUNK_SIZE;
+    static constexpr size_t slots_per_chunk = (chunk_size - first_slot) / slot_size;
+
+    static_assert(slot_alignment <= 4096, "chunks are only page aligned");
+
+    erikmt_object_pool() = default;
+    erikmt_object_pool(const erikmt_object_pool&) = delete;
+    erikmt_object_pool& operator=(const erikmt_object_pool&) = delete;
+
+    ~erikmt_object_pool() {
+        if (is_thread_pool) {
+            orphan();
+            return;
+        }
+        while (chunks) {
+            object_pool_chunk_s* next = chunks->next;
+            object_pool_unmap(chunks, chunk_size);
+            chunks = next;
+        }
+    }
+
+    // Uninitialized storage for one T, throws std::bad_alloc
+    T* allocate() {
+        void* slot = free_list;
+        if (slot) {
+            free_list = *static_cast<void**>(slot);
+            return static_cast<T*>(slot);
+        }
+        if (cur != end) {
+            slot = cur;
+            cur += slot_size;
+            return static_cast<T*>(slot);
+        }
+        return refill();
+    }
+
+    void deallocate(T* ptr) noexcept {
+        *reinterpret_cast<void**>(ptr) = free_list;
+        free_list = ptr;
+    }
+
+    template <typename... Args>
+    T* create(Args&&... args) {
+        T* ptr = allocate();
+        try {
+            return new (ptr) T(std::forward<Args>(args)...);
+        } catch (...) {
+            deallocate(ptr);
+            throw;
+        }
+    }
+
+    void destroy(T* ptr) {
+        ptr->~T();
+        deallocate(ptr);
+    }
+
+    // The calling thread's pool for T.  Its slots outlive the thread: on
+    // exit they're handed to the next thread pool for T that runs dry.
+    static erikmt_object_pool& thread_pool() {
+        static thread_local erikmt_object_pool pool(true);
+        return pool;
+    }
+
+private:
+    explicit erikmt_object_pool(bool thread_pool) : is_thread_pool(thread_pool) {
+    }
+
+    // Slow path: adopt slots left behind by exited threads, else map a chunk
+    T* refill() {
+        if (is_thread_pool && orphans.load(std::memory_order_relaxed)) {
+            free_list = orphans.exchange(nullptr, std::memory_order_acquire);
+        }
+        if (free_list) {
+            return allocate();
+        }
+
+        char* chunk = object_pool_map(chunk_size);
+        if (!chunk) {
+            throw std::bad_alloc();
+        }
+
+        // Thread pools never unmap, so they don't keep their chunks
+        if (!is_thread_pool) {
+            reinterpret_cast<object_pool_chunk_s*>(chunk)->next = chunks;
+            chunks = reinterpret_cast<object_pool_chunk_s*>(chunk);
+        }
+        cur = chunk + first_slot;
+        end = cur + slots_per_chunk * slot_size;
+
+        return allocate();
+    }
+
+    // Push every slot this thread pool still holds on the orphan list.  The
+    // list is only ever taken whole, so a CAS push is safe from ABA.
+    void orphan() {
+        while (cur != end) {
+            deallocate(reinterpret_cast<T*>(cur));
+            cur += slot_size;
+        }
+        if (!free_list) {
+            return;
+        }
+
+        void* last = free_list;
+        while (*static_cast<void**>(last)) {
+            last = *static_cast<void**>(last);
+        }
+
+        void* head = orphans.load(std::memory_order_relaxed);
+        do {
+            *static_cast<void**>(last) = head;
+        } while (!orphans.compare_exchange_weak(head, free_list, std::memory_order_release, std::memory_order_relaxed));
+        free_list = nullptr;
+    }
+
+    void* free_list = nullptr;
+    char* cur = nullptr; // Next never used slot in the newest chunk
+    char* end = nullptr;
+    object_pool_chunk_s* chunks = nullptr;
+    bool is_thread_pool = false;
+
+    static inline std::atomic<void*> orphans{nullptr};
+};
+
+// STL allocator that takes single objects (list, set and map nodes) from the
+// calling thread's erikmt_object_pool, and arrays from the heap
+template <typename T>
+class erikmt_object_allocator {
+public:
+    typedef T value_type;
+
+    erikmt_object_allocator() noexcept = default;
+
+    template <typename U>
+    erikmt_object_allocator(const erikmt_object_allocator<U>&) noexcept {
+    }
+
+    T* allocate(size_t n) {
+        if (n == 1) {
+            return erikmt_object_pool<T>::thread_pool().allocate();
+        }
+
+        void* ptr = (alignof(T) <= MIN_ALIGNMENT) ? tcache_alloc(n * sizeof(T)) : tcache_alloc_aligned(n * sizeof(T), alignof(T));
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, size_t n) noexcept {
+        if (n == 1) {
+            erikmt_object_pool<T>::thread_pool().deallocate(ptr);
+        } else {
+            tcache_free(ptr);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const erikmt_object_allocator<U>&) const noexcept {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const erikmt_object_allocator<U>&) const noexcept {
+        return false;
+    }
+};
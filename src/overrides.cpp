@@ -1,5 +1,6 @@
 #include <cstddef>
 #include <cstdint>
+#include <new>
 #include <stdexcept>
 #include <sys/mman.h>
 #include <type_traits>
@@ -8,24 +9,44 @@
 #include <mutex>
 
 #include "erikmtalloc.h"
+#include "size_classes.h"
+#include "slab.h"
+#include "thread_cache.h"
 #include "utils.h"
 
 using namespace std;
 
-mutex mut;
-
-// Check free list to see if we already have a large enough contiguous segment
-// If not, mmap more memory, beyond the nearest page boundary, and add to free list
+// Serve the request from the thread cache, which falls back to the shared heap
+// (under the global lock) to check the free list for a large enough segment,
+// or mmap more memory, beyond the nearest page boundary, and add it to the free list
 void* operator new(size_t size) {
     debug(std::cout, "NEW: Request for:", size, "bytes");
-    debug(std::cout, "Acquiring lock in operator::new");
 
-    unique_lock<mutex> allocation_lock(mut);
+    void* ptr = tcache_alloc(size);
+
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return tcache_alloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return tcache_alloc(size);
+}
 
-    void* ptr = get_segment(size);
+// Hinted placement new, see erikmt_alloc_hint()
+void* operator new(size_t size, erikmt_hint hint) {
+    debug(std::cout, "NEW: Request for:", size, "bytes with hint", static_cast<int>(hint));
 
-    debug(std::cout, "Releasing lock in operator::new");
-    allocation_lock.unlock();
+    void* ptr = erikmt_alloc_hint(size, hint);
 
     if (!ptr) {
         throw std::bad_alloc();
@@ -33,13 +54,108 @@ void* operator new(size_t size) {
     return ptr;
 }
 
+void* operator new[](size_t size, erikmt_hint hint) {
+    return operator new(size, hint);
+}
+
+// Only called when a constructor throws, the block is freed as usual
+void operator delete(void* ptr, erikmt_hint) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete[](void* ptr, erikmt_hint) noexcept {
+    operator delete(ptr);
+}
+
+// Over-aligned types (alignas() beyond __STDCPP_DEFAULT_NEW_ALIGNMENT__) get
+// their alignment natively from the slabs, segments or huge mappings
+void* operator new(size_t size, std::align_val_t alignment) {
+    debug(std::cout, "NEW: Request for:", size, "bytes aligned to", static_cast<size_t>(alignment));
+
+    void* ptr = tcache_alloc_aligned(size, static_cast<size_t>(alignment));
+
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return operator new(size, alignment);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return tcache_alloc_aligned(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return tcache_alloc_aligned(size, static_cast<size_t>(alignment));
+}
+
 void operator delete(void* ptr) noexcept {
-    debug(std::cout, "Acquiring lock in operator::delete");
-    unique_lock<mutex> allocation_lock(mut);
+    if (!ptr) {
+        return;
+    }
 
     debug(std::cout, "Delete for ptr", ptr);
-    free_segment(ptr);
+    tcache_free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    operator delete(ptr);
+}
+
+// The compiler passes the allocation size when it knows it, which lets the
+// block go back to its size class without a metadata lookup
+void operator delete(void* ptr, size_t size) noexcept {
+    if (!ptr) {
+        return;
+    }
+
+    debug(std::cout, "Delete for ptr", ptr, "with size", size);
+    tcache_free_sized(ptr, size);
+}
+
+void operator delete[](void* ptr, size_t size) noexcept {
+    operator delete(ptr, size);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    operator delete(ptr);
+}
 
-    debug(std::cout, "Releasing lock in operator::delete");
-    allocation_lock.unlock();
-}
\ No newline at end of file
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    operator delete(ptr);
+}
+
+// Aligned blocks may have been carved out of a larger segment, so their size
+// is looked up unless they came from an aligned slab class
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete(void* ptr, size_t size, std::align_val_t alignment) noexcept {
+    size_t align = static_cast<size_t>(alignment);
+
+    if (align <= SLAB_SLOT_ALIGNMENT && size <= SLAB_MAX_SIZE) {
+        operator delete(ptr, aligned_class_size(size, align));
+    } else {
+        operator delete(ptr);
+    }
+}
+
+void operator delete[](void* ptr, size_t size, std::align_val_t alignment) noexcept {
+    operator delete(ptr, size, alignment);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    operator delete(ptr);
+}
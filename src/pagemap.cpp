@@ -0,0 +1,134 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <sys/mman.h>
+
+#include "erikmtalloc_internal.h"
+#include "pagemap.h"
+#include "utils.h"
+
+// Three level radix tree over the 48-bit user address space, keyed by 4KB
+// page number, resolving any address to the chunk that owns it.  Each level
+// consumes 12 bits of the page number, so interior nodes and leaves are 32KB.
+// Nodes are mmap()ed on first use and never freed, which lets lookups run
+// without the global lock.  Missing nodes are installed with a CAS, so
+// disjoint ranges can be registered and removed concurrently without mut.
+#define PAGEMAP_PAGE_SHIFT 12
+#define PAGEMAP_LEVEL_BITS 12
+#define PAGEMAP_LEVEL_SIZE (1 << PAGEMAP_LEVEL_BITS)
+#define PAGEMAP_LEVEL_MASK (PAGEMAP_LEVEL_SIZE - 1)
+#define PAGEMAP_KEY_BITS (PAGEMAP_LEVEL_BITS * 3)
+
+struct pagemap_leaf_s {
+    std::atomic<chunk_s*> chunks[PAGEMAP_LEVEL_SIZE];
+};
+
+struct pagemap_node_s {
+    std::atomic<pagemap_leaf_s*> leaves[PAGEMAP_LEVEL_SIZE];
+};
+
+typedef struct pagemap_leaf_s pagemap_leaf_s;
+typedef struct pagemap_node_s pagemap_node_s;
+
+static std::atomic<pagemap_node_s*> pagemap_root[PAGEMAP_LEVEL_SIZE];
+
+// Zeroed mmap()ed memory is a valid array of null atomic pointers
+template <typename T>
+static T* map_node() {
+    void* ptr = mmap(NULL, sizeof(T), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (ptr == MAP_FAILED) ? nullptr : static_cast<T*>(ptr);
+}
+
+// Load a node pointer, installing a freshly mapped node if it's missing and
+// create is set.  If another thread wins the race its node is used instead.
+template <typename T>
+static T* get_node(std::atomic<T*>& entry, bool create) {
+    T* node = entry.load(std::memory_order_acquire);
+    if (node || !create) {
+        return node;
+    }
+
+    T* fresh = map_node<T>();
+    if (!fresh) {
+        return nullptr;
+    }
+    if (!entry.compare_exchange_strong(node, fresh, std::memory_order_acq_rel)) {
+        munmap(fresh, sizeof(T));
+        return node;
+    }
+    return fresh;
+}
+
+// Return the leaf slot for a page number, creating missing nodes if asked to
+static std::atomic<chunk_s*>* get_entry(uintptr_t key, bool create) {
+    if (key >> PAGEMAP_KEY_BITS) {
+        return nullptr;
+    }
+
+    pagemap_node_s* node = get_node(pagemap_root[key >> (PAGEMAP_LEVEL_BITS * 2)], create);
+    if (!node) {
+        return nullptr;
+    }
+
+    pagemap_leaf_s* leaf = get_node(node->leaves[(key >> PAGEMAP_LEVEL_BITS) & PAGEMAP_LEVEL_MASK], create);
+    if (!leaf) {
+        return nullptr;
+    }
+
+    return &leaf->chunks[key & PAGEMAP_LEVEL_MASK];
+}
+
+// Point every page of [start, start + size) at chunk
+void pagemap_register(void* start, size_t size, chunk_s* chunk) {
+    uintptr_t first = reinterpret_cast<uintptr_t>(start) >> PAGEMAP_PAGE_SHIFT;
+    uintptr_t last = (reinterpret_cast<uintptr_t>(start) + size - 1) >> PAGEMAP_PAGE_SHIFT;
+
+    for (uintptr_t key = first; key <= last; ++key) {
+        std::atomic<chunk_s*>* entry = get_entry(key, true);
+        if (entry) {
+            entry->store(chunk, std::memory_order_release);
+        }
+    }
+}
+
+// Clear the pages of [start, start + size) before they're unmapped
+void pagemap_unregister(void* start, size_t size) {
+    uintptr_t first = reinterpret_cast<uintptr_t>(start) >> PAGEMAP_PAGE_SHIFT;
+    uintptr_t last = (reinterpret_cast<uintptr_t>(start) + size - 1) >> PAGEMAP_PAGE_SHIFT;
+
+    for (uintptr_t key = first; key <= last; ++key) {
+        std::atomic<chunk_s*>* entry = get_entry(key, false);
+        if (entry) {
+            entry->store(nullptr, std::memory_order_release);
+        }
+    }
+}
+
+// Return the chunk owning ptr, or nullptr if it wasn't allocated by us
+chunk_s* pagemap_lookup(const void* ptr) {
+    std::atomic<chunk_s*>* entry = get_entry(reinterpret_cast<uintptr_t>(ptr) >> PAGEMAP_PAGE_SHIFT, false);
+    return entry ? entry->load(std::memory_order_acquire) : nullptr;
+}
+
+// Call fn once for every registered chunk, in address order, must hold mut
+void pagemap_for_each_chunk(void (*fn)(chunk_s* chunk)) {
+    for (uintptr_t i = 0; i < PAGEMAP_LEVEL_SIZE; ++i) {
+        pagemap_node_s* node = pagemap_root[i].load(std::memory_order_acquire);
+        if (!node) continue;
+
+        for (uintptr_t j = 0; j < PAGEMAP_LEVEL_SIZE; ++j) {
+            pagemap_leaf_s* leaf = node->leaves[j].load(std::memory_order_acquire);
+            if (!leaf) continue;
+
+            for (uintptr_t k = 0; k < PAGEMAP_LEVEL_SIZE; ++k) {
+                chunk_s* chunk = leaf->chunks[k].load(std::memory_order_acquire);
+                uintptr_t key = (i << (PAGEMAP_LEVEL_BITS * 2)) | (j << PAGEMAP_LEVEL_BITS) | k;
+
+                // Chunks span several pages, only report them from their first page
+                if (chunk && reinterpret_cast<uintptr_t>(chunk) >> PAGEMAP_PAGE_SHIFT == key) {
+                    fn(chunk);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstddef>
+
+#include "erikmtalloc_internal.h"
+
+void pagemap_register(void* start, size_t size, chunk_s* chunk);
+void pagemap_unregister(void* start, size_t size);
+chunk_s* pagemap_lookup(const void* ptr);
+void pagemap_for_each_chunk(void (*fn)(chunk_s* chunk));
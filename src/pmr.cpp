@@ -0,0 +1,263 @@
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+
+#include "chunk_cache.h"
+#include "erikmtalloc.h"
+#include "erikmtalloc_internal.h"
+#include "pmr.h"
+#include "size_classes.h"
+#include "slab.h"
+#include "thread_cache.h"
+#include "utils.h"
+
+// Same path as the aligned operator new/delete
+static void* pool_alloc(size_t bytes, size_t alignment) {
+    void* ptr = (alignment <= MIN_ALIGNMENT) ? tcache_alloc(bytes) : tcache_alloc_aligned(bytes, alignment);
+
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+static void pool_free(void* ptr, size_t bytes, size_t alignment) {
+    if (alignment <= MIN_ALIGNMENT) {
+        tcache_free_sized(ptr, bytes);
+    } else if (alignment <= SLAB_SLOT_ALIGNMENT && bytes <= SLAB_MAX_SIZE) {
+        tcache_free_sized(ptr, aligned_class_size(bytes, alignment));
+    } else {
+        tcache_free(ptr);
+    }
+}
+
+void* erikmt_pool_resource::do_allocate(size_t bytes, size_t alignment) {
+    return pool_alloc(bytes, alignment);
+}
+
+void erikmt_pool_resource::do_deallocate(void* ptr, size_t bytes, size_t alignment) {
+    pool_free(ptr, bytes, alignment);
+}
+
+// Every erikmt_pool_resource allocates from the same heap
+bool erikmt_pool_resource::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+    return dynamic_cast<const erikmt_pool_resource*>(&other) != nullptr;
+}
+
+erikmt_pool_resource* erikmt_pool() {
+    static erikmt_pool_resource pool;
+    return &pool;
+}
+
+static bool is_local_size(size_t bytes, size_t alignment) {
+    return bytes <= MAX_CACHED_SIZE && alignment <= MIN_ALIGNMENT;
+}
+
+erikmt_local_pool_resource::~erikmt_local_pool_resource() {
+    release();
+}
+
+void erikmt_local_pool_resource::release() {
+    for (size_t index = 0; index < SIZE_CLASS_COUNT; ++index) {
+        while (free_counts[index]) {
+            flush(index, CACHE_MAX_BATCH);
+        }
+    }
+}
+
+// Take a batch of blocks from the heap, keep all but the first
+void* erikmt_local_pool_resource::refill(size_t index) {
+    void* blocks[CACHE_MAX_BATCH];
+    size_t count = tcache_alloc_batch(size_class_size(index), size_class_batch(index), blocks);
+
+    if (!count) {
+        throw std::bad_alloc();
+    }
+
+    for (size_t i = 1; i < count; ++i) {
+        *static_cast<void**>(blocks[i]) = free_lists[index];
+        free_lists[index] = blocks[i];
+    }
+    free_counts[index] += count - 1;
+
+    return blocks[0];
+}
+
+// Return up to count blocks from the head of a free list to the heap
+void erikmt_local_pool_resource::flush(size_t index, unsigned int count) {
+    void* blocks[CACHE_MAX_BATCH];
+    unsigned int n = 0;
+
+    while (n < count && n < CACHE_MAX_BATCH && free_lists[index]) {
+        blocks[n] = free_lists[index];
+        free_lists[index] = *static_cast<void**>(blocks[n]);
+        ++n;
+    }
+    free_counts[index] -= n;
+
+    tcache_free_batch(blocks, n);
+}
+
+void* erikmt_local_pool_resource::do_allocate(size_t bytes, size_t alignment) {
+    if (!is_local_size(bytes, alignment)) {
+        return pool_alloc(bytes, alignment);
+    }
+
+    size_t index = size_class_index(bytes);
+    void* ptr = free_lists[index];
+
+    if (!ptr) {
+        return refill(index);
+    }
+
+    free_lists[index] = *static_cast<void**>(ptr);
+    free_counts[index] -= 1;
+    return ptr;
+}
+
+void erikmt_local_pool_resource::do_deallocate(void* ptr, size_t bytes, size_t alignment) {
+    if (!is_local_size(bytes, alignment)) {
+        pool_free(ptr, bytes, alignment);
+        return;
+    }
+
+    size_t index = size_class_index(bytes);
+    *static_cast<void**>(ptr) = free_lists[index];
+    free_lists[index] = ptr;
+    free_counts[index] += 1;
+
+    // Keep at most two batches around
+    unsigned int batch = size_class_batch(index);
+    if (free_counts[index] > batch * 2) {
+        flush(index, batch);
+    }
+}
+
+bool erikmt_local_pool_resource::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+    return this == &other;
+}
+
+static size_t round_to_pages(size_t size) {
+    return (size + get_pagesize() - 1) & ~(get_pagesize() - 1);
+}
+
+// Arena blocks come from the chunk cache, so a short lived arena usually
+// reuses a chunk the heap (or another arena) let go of
+static char* map_arena_block(size_t size) {
+    return chunk_cache_map(size);
+}
+
+static void unmap_arena_block(void* block, size_t size) {
+    chunk_cache_unmap(static_cast<char*>(block), size);
+    chunk_cache_release_evicted();
+}
+
+static char* align_up(char* ptr, size_t alignment) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    return reinterpret_cast<char*>((addr + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1));
+}
+
+erikmt_arena::erikmt_arena(size_t initial_size)
+    : next_size(initial_size ? round_to_pages(initial_size) : DEFAULT_CHUNK_SIZE) {
+}
+
+erikmt_arena::~erikmt_arena() {
+    release();
+}
+
+// Map a new block big enough for the request, the next one is twice as large
+void* erikmt_arena::grow(size_t bytes, size_t alignment) {
+    size_t size = round_to_pages(sizeof(block_s) + bytes + alignment);
+    if (size < next_size) {
+        size = next_size;
+    }
+
+    char* ptr = map_arena_block(size);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+
+    debug(std::cout, "Arena mapped block", static_cast<void*>(ptr), "with size:", size, "bytes");
+
+    block_s* block = reinterpret_cast<block_s*>(ptr);
+    block->next = blocks;
+    block->size = size;
+    blocks = block;
+    cur = ptr + sizeof(block_s);
+    end = ptr + size;
+
+    if (next_size < ARENA_MAX_BLOCK_SIZE) {
+        next_size *= 2;
+    }
+
+    char* result = align_up(cur, alignment);
+    cur = result + bytes;
+    return result;
+}
+
+void* erikmt_arena::do_allocate(size_t bytes, size_t alignment) {
+    used += bytes;
+
+    if (cur) {
+        char* result = align_up(cur, alignment);
+        if (result + bytes <= end) {
+            cur = result + bytes;
+            return result;
+        }
+    }
+    return grow(bytes, alignment);
+}
+
+void erikmt_arena::do_deallocate(void*, size_t, size_t) {
+}
+
+bool erikmt_arena::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+    return this == &other;
+}
+
+// Unmap the blocks mapped after block, and continue from pos in it
+void erikmt_arena::rewind(block_s* block, char* pos, size_t used_before) {
+    while (blocks != block) {
+        block_s* next = blocks->next;
+        unmap_arena_block(blocks, blocks->size);
+        blocks = next;
+    }
+
+    cur = pos;
+    end = block ? reinterpret_cast<char*>(block) + block->size : nullptr;
+    used = used_before;
+}
+
+void erikmt_arena::reset() {
+    if (!blocks) {
+        return;
+    }
+
+    block_s* newest = blocks;
+    blocks = newest->next;
+    rewind(nullptr, nullptr, 0);
+
+    newest->next = nullptr;
+    blocks = newest;
+    cur = reinterpret_cast<char*>(newest) + sizeof(block_s);
+    end = reinterpret_cast<char*>(newest) + newest->size;
+}
+
+void erikmt_arena::release() {
+    rewind(nullptr, nullptr, 0);
+}
+
+erikmt_arena_scope::erikmt_arena_scope(erikmt_arena& arena)
+    : arena(arena), block(arena.blocks), pos(arena.cur), used(arena.used) {
+}
+
+// A scope opened on an empty arena keeps its newest block, like reset()
+erikmt_arena_scope::~erikmt_arena_scope() {
+    if (block) {
+        arena.rewind(block, pos, used);
+    } else {
+        arena.reset();
+    }
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+
+#include "size_classes.h"
+
+#define ARENA_MAX_BLOCK_SIZE 1024*1024*4 // Arena mappings double in size up to 4MB
+
+// std::pmr::memory_resource adapters over erikmtalloc, e.g.
+//   erikmt_arena arena;
+//   std::pmr::vector<int> v(&arena);
+
+// Thread safe resource, allocates through the per-CPU/thread caches like new
+class erikmt_pool_resource : public std::pmr::memory_resource {
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* ptr, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
+
+// Shared resource of erikmt_pool_resource type, usable as the default with
+// std::pmr::set_default_resource()
+erikmt_pool_resource* erikmt_pool();
+
+// Resource for use by a single thread.  Size class blocks are kept on
+// private free lists without any locking, refilled and flushed in batches
+// with erikmt_alloc_batch()/erikmt_free_batch().  Larger or over-aligned
+// requests go straight to the heap.
+class erikmt_local_pool_resource : public std::pmr::memory_resource {
+public:
+    erikmt_local_pool_resource() = default;
+    erikmt_local_pool_resource(const erikmt_local_pool_resource&) = delete;
+    erikmt_local_pool_resource& operator=(const erikmt_local_pool_resource&) = delete;
+    ~erikmt_local_pool_resource();
+
+    // Hand the blocks on the free lists back to the heap
+    void release();
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* ptr, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+private:
+    void* refill(size_t index);
+    void flush(size_t index, unsigned int count);
+
+    void* free_lists[SIZE_CLASS_COUNT] = {};
+    unsigned int free_counts[SIZE_CLASS_COUNT] = {};
+};
+
+// Monotonic arena that bump allocates out of mmap()ed chunks and frees
+// everything at once, deallocate() is a no-op.  Not thread safe.
+class erikmt_arena : public std::pmr::memory_resource {
+public:
+    explicit erikmt_arena(size_t initial_size = 0);
+    erikmt_arena(const erikmt_arena&) = delete;
+    erikmt_arena& operator=(const erikmt_arena&) = delete;
+    ~erikmt_arena();
+
+    // Free everything, keeping the newest (largest) mapping for reuse
+    void reset();
+    // Free everything and unmap all of it
+    void release();
+    // Bytes handed out since the last reset()
+    size_t bytes_used() const { return used; }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* ptr, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+private:
+    friend class erikmt_arena_scope;
+
+    struct block_s {
+        block_s* next; // Previously mapped block
+        size_t size;
+    };
+
+    void* grow(size_t bytes, size_t alignment);
+    void rewind(block_s* block, char* pos, size_t used_before);
+
+    block_s* blocks = nullptr; // Newest first
+    char* cur = nullptr;
+    char* end = nullptr;
+    size_t next_size;
+    size_t used = 0;
+};
+
+// Frees everything allocated from the arena while the scope was alive when
+// it goes out of scope, e.g. for the temporaries of a single request.  Scopes
+// nest, but the arena mustn't be reset() or released() inside of one.
+class erikmt_arena_scope {
+public:
+    explicit erikmt_arena_scope(erikmt_arena& arena);
+    erikmt_arena_scope(const erikmt_arena_scope&) = delete;
+    erikmt_arena_scope& operator=(const erikmt_arena_scope&) = delete;
+    ~erikmt_arena_scope();
+
+private:
+    erikmt_arena& arena;
+    erikmt_arena::block_s* block;
+    char* pos;
+    size_t used;
+};
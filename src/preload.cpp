@@ -0,0 +1,105 @@
+#include <cstddef>
+#include <cstdlib>
+#include <malloc.h>
+#include <mutex>
+#include <pthread.h>
+
+#include "chunk_cache.h"
+#include "cpu_cache.h"
+#include "erikmtalloc.h"
+#include "erikmtalloc_internal.h"
+#include "huge.h"
+#include "profile.h"
+#include "slab.h"
+#include "stats.h"
+#include "thread_cache.h"
+
+// Exports the C allocation API under the libc names, so that loading
+// liberikmtalloc.so with LD_PRELOAD routes every malloc() in the process
+// (libc internals and third party libraries included) to erikmtalloc.
+
+extern "C" {
+
+void* malloc(size_t size) noexcept {
+    return erikmt_malloc(size);
+}
+
+void free(void* ptr) noexcept {
+    erikmt_free(ptr);
+}
+
+void* calloc(size_t count, size_t size) noexcept {
+    return erikmt_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) noexcept {
+    return erikmt_realloc(ptr, size);
+}
+
+int posix_memalign(void** out, size_t alignment, size_t size) noexcept {
+    return erikmt_posix_memalign(out, alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept {
+    return erikmt_aligned_alloc(alignment, size);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept {
+    return erikmt_aligned_alloc(alignment, size);
+}
+
+void* valloc(size_t size) noexcept {
+    return erikmt_aligned_alloc(get_pagesize(), size);
+}
+
+void* pvalloc(size_t size) noexcept {
+    return erikmt_aligned_alloc(get_pagesize(), (size + get_pagesize() - 1) & ~(get_pagesize() - 1));
+}
+
+size_t malloc_usable_size(void* ptr) noexcept {
+    return erikmt_malloc_usable_size(ptr);
+}
+
+}
+
+// Hold the allocator's locks across fork(), in their usual order, so the
+// child never inherits one locked by a thread that doesn't exist on its side
+static void lock_allocator() {
+    mut.lock();
+    slab_lock_all();
+    chunk_cache_lock_all();
+    huge_lock_all();
+    cpu_cache_lock_all();
+    stats_lock_all();
+}
+
+static void unlock_allocator() {
+    stats_unlock_all();
+    cpu_cache_unlock_all();
+    huge_unlock_all();
+    chunk_cache_unlock_all();
+    slab_unlock_all();
+    mut.unlock();
+}
+
+__attribute__((constructor)) static void register_fork_handlers() {
+    pthread_atfork(lock_allocator, unlock_allocator, unlock_allocator);
+}
+
+// Set ERIKMT_BACKGROUND_PURGE=1 to purge idle memory from a background thread
+__attribute__((constructor)) static void maybe_start_purge_thread() {
+    const char* env = getenv("ERIKMT_BACKGROUND_PURGE");
+    if (env && env[0] == '1') {
+        start_purge_thread();
+    }
+}
+
+// Set ERIKMT_PROFILE_SIGNAL to a signal number (e.g. 12 for SIGUSR2) to dump
+// a heap profile to ERIKMT_PROFILE_FILE.<pid>.<n>.heap on every delivery
+__attribute__((constructor)) static void maybe_dump_profile_on_signal() {
+    const char* env = getenv("ERIKMT_PROFILE_SIGNAL");
+    if (env && atoi(env) > 0) {
+        const char* prefix = getenv("ERIKMT_PROFILE_FILE");
+        erikmt_profile_on_signal(atoi(env), prefix ? prefix : "erikmt");
+    }
+}
@@ -0,0 +1,432 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <system_error>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+#include "profile.h"
+
+// Each thread counts down the bytes it allocates from a random interval drawn
+// from an exponential distribution with mean profile_rate, and samples the
+// allocation that crosses zero.  That samples each byte with probability
+// 1/rate, independently of allocation sizes, which is what pprof expects when
+// it scales the samples back up (heap_v2).
+//
+// Samples live in a fixed array, indexed by address through a chained hash
+// table, all under profile_lock.  Frees only take the lock if their hash
+// bucket is non-empty, which with PROFILE_BUCKETS buckets is rare.  Both
+// tables are mmap()ed on the first sample, so the profiler never allocates
+// from the heap it's profiling.
+struct profile_sample_s {
+    uintptr_t address; // 0 while on the free list
+    size_t size;       // Requested size
+    uint32_t next;     // Next sample in the bucket or on the free list, 1 based
+    uint32_t depth;
+    void* stack[PROFILE_MAX_DEPTH];
+};
+
+typedef struct profile_sample_s profile_sample_s;
+
+std::atomic<size_t> profile_rate;
+std::atomic<size_t> profile_live_samples;
+
+static profile_sample_s* samples;
+static std::atomic<uint32_t>* buckets;
+static uint32_t free_samples;   // Head of the free list
+static uint32_t used_samples;   // Samples ever handed out of the array
+static size_t last_rate;        // Rate of the most recent samples
+static uint64_t dropped_samples;
+static std::atomic_flag profile_lock = ATOMIC_FLAG_INIT;
+
+static thread_local int64_t bytes_until_sample __attribute__((tls_model("initial-exec")));
+static thread_local uint64_t random_state __attribute__((tls_model("initial-exec")));
+static thread_local bool in_profiler __attribute__((tls_model("initial-exec")));
+
+static void lock_profile() {
+    while (profile_lock.test_and_set(std::memory_order_acquire)) {
+        sched_yield();
+    }
+}
+
+static void unlock_profile() {
+    profile_lock.clear(std::memory_order_release);
+}
+
+static size_t bucket_of(uintptr_t address) {
+    return ((address >> 4) * 0x9e3779b97f4a7c15ull) >> (64 - 18);
+}
+
+static_assert(PROFILE_BUCKETS == 1 << 18, "bucket_of() returns 18 bits");
+
+// Map the sample array and hash table, with profile_lock held
+static bool map_tables() {
+    void* s = mmap(NULL, sizeof(profile_sample_s) * PROFILE_MAX_SAMPLES, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (s == MAP_FAILED) {
+        return false;
+    }
+
+    void* b = mmap(NULL, sizeof(std::atomic<uint32_t>) * PROFILE_BUCKETS, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (b == MAP_FAILED) {
+        munmap(s, sizeof(profile_sample_s) * PROFILE_MAX_SAMPLES);
+        return false;
+    }
+
+    samples = static_cast<profile_sample_s*>(s);
+    buckets = static_cast<std::atomic<uint32_t>*>(b);
+    return true;
+}
+
+// xorshift64*, seeded per thread
+static uint64_t next_random() {
+    if (random_state == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        random_state = (reinterpret_cast<uintptr_t>(&random_state) ^ ts.tv_nsec) | 1;
+    }
+
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545f4914f6cdd1dull;
+}
+
+// Bytes until the next sample, exponentially distributed with mean rate
+static int64_t next_interval(size_t rate) {
+    double u = static_cast<double>((next_random() >> 11) + 1) / 9007199254740992.0; // (0, 1]
+    double interval = -std::log(u) * rate;
+    return (interval < 1.0) ? 1 : (interval > 1e18) ? INT64_MAX : static_cast<int64_t>(interval);
+}
+
+static void insert_sample(void* ptr, size_t size, void** stack, int depth) {
+    lock_profile();
+
+    if (!samples && !map_tables()) {
+        unlock_profile();
+        return;
+    }
+
+    uint32_t index = free_samples;
+    if (index) {
+        free_samples = samples[index - 1].next;
+    } else if (used_samples < PROFILE_MAX_SAMPLES) {
+        index = ++used_samples;
+    } else {
+        ++dropped_samples;
+        unlock_profile();
+        return;
+    }
+
+    profile_sample_s* sample = &samples[index - 1];
+    uintptr_t address = reinterpret_cast<uintptr_t>(ptr);
+    std::atomic<uint32_t>* bucket = &buckets[bucket_of(address)];
+
+    sample->address = address;
+    sample->size = size;
+    sample->depth = depth;
+    memcpy(sample->stack, stack, depth * sizeof(void*));
+    sample->next = bucket->load(std::memory_order_relaxed);
+    bucket->store(index, std::memory_order_release);
+    profile_live_samples.fetch_add(1, std::memory_order_relaxed);
+
+    unlock_profile();
+}
+
+void profile_sample_alloc(void* ptr, size_t size) {
+    if (in_profiler) {
+        return;
+    }
+
+    size_t rate = profile_rate.load(std::memory_order_relaxed);
+    if (bytes_until_sample == 0) {
+        // First allocation on this thread
+        bytes_until_sample = next_interval(rate);
+    }
+
+    bytes_until_sample -= static_cast<int64_t>(size);
+    if (bytes_until_sample >= 0) {
+        return;
+    }
+    bytes_until_sample = next_interval(rate);
+
+    // backtrace() allocates the first time it's called, loading the unwinder
+    in_profiler = true;
+    void* stack[PROFILE_MAX_DEPTH + 1];
+    int depth = backtrace(stack, PROFILE_MAX_DEPTH + 1);
+
+    // Leave out this function's own frame
+    if (depth > 0) {
+        insert_sample(ptr, size, stack + 1, depth - 1);
+    }
+    in_profiler = false;
+}
+
+// Drop the sample of a freed allocation, if it has one
+void profile_forget(void* ptr) {
+    uintptr_t address = reinterpret_cast<uintptr_t>(ptr);
+    std::atomic<uint32_t>* bucket = &buckets[bucket_of(address)];
+
+    if (bucket->load(std::memory_order_acquire) == 0) {
+        return;
+    }
+
+    lock_profile();
+
+    std::atomic<uint32_t>* link = bucket;
+    uint32_t index = link->load(std::memory_order_relaxed);
+    uint32_t* prev = nullptr;
+
+    while (index && samples[index - 1].address != address) {
+        prev = &samples[index - 1].next;
+        index = *prev;
+    }
+
+    if (index) {
+        profile_sample_s* sample = &samples[index - 1];
+        if (prev) {
+            *prev = sample->next;
+        } else {
+            link->store(sample->next, std::memory_order_relaxed);
+        }
+
+        sample->address = 0;
+        sample->next = free_samples;
+        free_samples = index;
+        profile_live_samples.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    unlock_profile();
+}
+
+// Sample about once every bytes allocated, 0 stops sampling.  Samples already
+// taken stay until their allocations are freed.  Threads pick up a new rate
+// after their next sample.
+void erikmt_profile_set_rate(size_t bytes) {
+    if (bytes) {
+        lock_profile();
+        last_rate = bytes;
+        unlock_profile();
+    }
+    profile_rate.store(bytes, std::memory_order_relaxed);
+}
+
+// Output buffered on the stack, so dumping doesn't allocate
+struct profile_writer_s {
+    int fd;
+    bool ok;
+    size_t used;
+    char buf[4096];
+};
+
+typedef struct profile_writer_s profile_writer_s;
+
+static void flush_writer(profile_writer_s* w) {
+    const char* p = w->buf;
+    while (w->ok && w->used) {
+        ssize_t n = write(w->fd, p, w->used);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            w->ok = false;
+            break;
+        }
+        p += n;
+        w->used -= n;
+    }
+    w->used = 0;
+}
+
+__attribute__((format(printf, 2, 3))) static void write_format(profile_writer_s* w, const char* format, ...) {
+    if (sizeof(w->buf) - w->used < 256) {
+        flush_writer(w);
+    }
+
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(w->buf + w->used, sizeof(w->buf) - w->used, format, args);
+    va_end(args);
+
+    if (n > 0) {
+        w->used += std::min(static_cast<size_t>(n), sizeof(w->buf) - w->used - 1);
+    }
+}
+
+static bool same_stack(const profile_sample_s* a, const profile_sample_s* b) {
+    return a->depth == b->depth && memcmp(a->stack, b->stack, a->depth * sizeof(void*)) == 0;
+}
+
+static bool stack_less(const profile_sample_s& a, const profile_sample_s& b) {
+    if (a.depth != b.depth) {
+        return a.depth < b.depth;
+    }
+    return memcmp(a.stack, b.stack, a.depth * sizeof(void*)) < 0;
+}
+
+// Write the live samples to path as a heap profile in the legacy text format
+// pprof reads ("heap_v2"), with the in use samples grouped by stack and the
+// process' mappings for symbolization.  Returns 0, or -1 with errno set.
+int erikmt_profile_dump(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Copy the samples out, so they can be sorted and written without
+    // holding profile_lock
+    lock_profile();
+    size_t count = profile_live_samples.load(std::memory_order_relaxed);
+    size_t rate = last_rate;
+    size_t snapshot_size = std::max<size_t>(count, 1) * sizeof(profile_sample_s);
+    void* mapped = mmap(NULL, snapshot_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        unlock_profile();
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    profile_sample_s* snapshot = static_cast<profile_sample_s*>(mapped);
+    size_t copied = 0;
+    for (uint32_t i = 0; i < used_samples && copied < count; ++i) {
+        if (samples[i].address) {
+            snapshot[copied++] = samples[i];
+        }
+    }
+    unlock_profile();
+
+    std::sort(snapshot, snapshot + copied, stack_less);
+
+    uint64_t total_bytes = 0;
+    for (size_t i = 0; i < copied; ++i) {
+        total_bytes += snapshot[i].size;
+    }
+
+    profile_writer_s w;
+    w.fd = fd;
+    w.ok = true;
+    w.used = 0;
+
+    write_format(&w, "heap profile: %zu: %llu [%zu: %llu] @ heap_v2/%zu\n", copied,
+        static_cast<unsigned long long>(total_bytes), copied, static_cast<unsigned long long>(total_bytes),
+        rate ? rate : 1);
+
+    for (size_t i = 0; i < copied;) {
+        size_t end = i;
+        uint64_t bytes = 0;
+        while (end < copied && same_stack(&snapshot[i], &snapshot[end])) {
+            bytes += snapshot[end].size;
+            ++end;
+        }
+
+        write_format(&w, "%zu: %llu [%zu: %llu] @", end - i, static_cast<unsigned long long>(bytes), end - i,
+            static_cast<unsigned long long>(bytes));
+        for (uint32_t frame = 0; frame < snapshot[i].depth; ++frame) {
+            write_format(&w, " %p", snapshot[i].stack[frame]);
+        }
+        write_format(&w, "\n");
+        i = end;
+    }
+
+    munmap(mapped, snapshot_size);
+
+    write_format(&w, "\nMAPPED_LIBRARIES:\n");
+    flush_writer(&w);
+
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0) {
+        ssize_t n;
+        while (w.ok && (n = read(maps, w.buf, sizeof(w.buf))) > 0) {
+            w.used = n;
+            flush_writer(&w);
+        }
+        close(maps);
+    }
+
+    int saved_errno = errno;
+    close(fd);
+    if (!w.ok) {
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+// Profiles are dumped by a thread of their own, since the signal handler can
+// only post a semaphore
+static sem_t dump_requested;
+static char dump_prefix[256];
+
+static void request_dump(int) {
+    sem_post(&dump_requested);
+}
+
+// Dump a profile to <prefix>.<pid>.<n>.heap every time signum is delivered.
+// Returns 0, or -1 with errno set.
+int erikmt_profile_on_signal(int signum, const char* prefix) {
+    static std::atomic<bool> started{false};
+    if (started.exchange(true)) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    snprintf(dump_prefix, sizeof(dump_prefix), "%s", prefix);
+    sem_init(&dump_requested, 0, 0);
+
+    try {
+        std::thread([]() {
+            for (unsigned int n = 1;; ++n) {
+                while (sem_wait(&dump_requested) != 0) {
+                }
+
+                char path[sizeof(dump_prefix) + 64];
+                snprintf(path, sizeof(path), "%s.%d.%u.heap", dump_prefix, getpid(), n);
+                erikmt_profile_dump(path);
+            }
+        }).detach();
+    } catch (const std::system_error&) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_dump;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(signum, &action, nullptr);
+}
+
+// A child forked while another thread held profile_lock would never see it
+// released
+static void profile_fork_prepare() {
+    lock_profile();
+}
+
+static void profile_fork_release() {
+    unlock_profile();
+}
+
+__attribute__((constructor)) static void init_profile() {
+    pthread_atfork(profile_fork_prepare, profile_fork_release, profile_fork_release);
+
+    const char* env = getenv("ERIKMT_PROFILE_RATE");
+    if (env) {
+        erikmt_profile_set_rate(strtoull(env, nullptr, 10));
+    }
+}
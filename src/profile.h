@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Sampling heap profiler.  With a sampling rate of N bytes, allocations are
+// sampled about once every N bytes allocated (each byte has a 1/N chance), and
+// each sample keeps the allocation's stack until it's freed.  Set
+// ERIKMT_PROFILE_RATE (0, the default, turns sampling off), or call
+// erikmt_profile_set_rate().
+#define PROFILE_MAX_DEPTH 32        // Stack frames kept per sample
+#define PROFILE_MAX_SAMPLES 65536   // Live samples kept, more are dropped
+#define PROFILE_BUCKETS (1 << 18)   // Hash buckets indexing live samples by address
+
+extern std::atomic<size_t> profile_rate;
+extern std::atomic<size_t> profile_live_samples;
+
+void profile_sample_alloc(void* ptr, size_t size);
+void profile_forget(void* ptr);
+
+// Called on every allocation, only leaves the fast path while sampling
+static inline void profile_record_alloc(void* ptr, size_t size) {
+    if (__builtin_expect(profile_rate.load(std::memory_order_relaxed) != 0, 0) && ptr) {
+        profile_sample_alloc(ptr, size);
+    }
+}
+
+// Called on every free, only leaves the fast path while samples are live
+static inline void profile_record_free(void* ptr) {
+    if (__builtin_expect(profile_live_samples.load(std::memory_order_relaxed) != 0, 0)) {
+        profile_forget(ptr);
+    }
+}
+
+void erikmt_profile_set_rate(size_t bytes);
+int erikmt_profile_dump(const char* path);
+int erikmt_profile_on_signal(int signum, const char* prefix);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+
+// File format shared by the allocation recorder (librecord.so) and the replay
+// benchmark (replay_bench): a record_file_header_s followed by records in
+// roughly chronological order, each carrying a global sequence number.
+#define RECORD_MAGIC "ERIKMTRC"
+#define RECORD_VERSION 1
+#define RECORD_BUFFER_RECORDS 4096 // Records buffered per thread between write()s
+
+enum record_op : uint8_t {
+    RECORD_MALLOC,   // address = malloc(size)
+    RECORD_CALLOC,   // address = calloc(1, size)
+    RECORD_MEMALIGN, // address = aligned to argument, size bytes
+    RECORD_REALLOC,  // address = realloc(argument, size)
+    RECORD_FREE,     // free(address)
+};
+
+struct record_s {
+    uint64_t sequence; // Global order of the calls
+    uint64_t address;
+    uint64_t argument;
+    uint64_t size;
+    uint32_t thread;   // Kernel thread id
+    uint8_t op;
+    uint8_t unused[3];
+};
+
+struct record_file_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+typedef struct record_s record_s;
+typedef struct record_file_header_s record_file_header_s;
+
+static_assert(sizeof(record_s) == 40, "record_s is part of the recording file format");
@@ -0,0 +1,256 @@
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "record.h"
+
+// LD_PRELOAD shim that records every malloc(), free() and friends of a
+// process, with the calling thread, into ERIKMT_RECORD_FILE (erikmt.rec by
+// default), and forwards the call to the allocator below it (glibc's unless
+// something else is preloaded after it).  Replay the recording with
+// replay_bench, or `make replay RECORDING=...`.
+//
+// Each thread buffers its records in an mmap()ed buffer and appends it to the
+// file with a single write() once full, on thread exit and at process exit.
+// The recorder itself never allocates.
+
+struct record_buffer_s {
+    record_buffer_s* next; // Every buffer ever created
+    uint32_t thread;
+    uint32_t count;
+    record_s records[RECORD_BUFFER_RECORDS];
+};
+
+typedef struct record_buffer_s record_buffer_s;
+
+typedef void* (*malloc_fn)(size_t);
+typedef void (*free_fn)(void*);
+typedef void* (*calloc_fn)(size_t, size_t);
+typedef void* (*realloc_fn)(void*, size_t);
+typedef int (*posix_memalign_fn)(void**, size_t, size_t);
+typedef void* (*aligned_alloc_fn)(size_t, size_t);
+
+static malloc_fn real_malloc;
+static free_fn real_free;
+static calloc_fn real_calloc;
+static realloc_fn real_realloc;
+static posix_memalign_fn real_posix_memalign;
+static aligned_alloc_fn real_aligned_alloc;
+static aligned_alloc_fn real_memalign;
+
+static int record_fd = -1;
+static std::atomic<uint64_t> sequence;
+static std::atomic<record_buffer_s*> buffers;
+static pthread_key_t buffer_key;
+
+static thread_local record_buffer_s* buffer __attribute__((tls_model("initial-exec")));
+// Set while the recorder itself runs, so calls it causes aren't recorded
+static thread_local bool in_recorder __attribute__((tls_model("initial-exec")));
+
+// dlsym() allocates before the real functions are known, so those early
+// requests are served from a static arena and never freed
+static char bootstrap_arena[16384] __attribute__((aligned(16)));
+static size_t bootstrap_used;
+
+static void* bootstrap_alloc(size_t size) {
+    size = (size + 15) & ~static_cast<size_t>(15);
+    if (bootstrap_used + size > sizeof(bootstrap_arena)) {
+        return nullptr;
+    }
+    void* ptr = bootstrap_arena + bootstrap_used;
+    bootstrap_used += size;
+    return ptr;
+}
+
+static bool is_bootstrap(void* ptr) {
+    return ptr >= bootstrap_arena && ptr < bootstrap_arena + sizeof(bootstrap_arena);
+}
+
+static void flush_buffer(record_buffer_s* b) {
+    if (b->count == 0 || record_fd < 0) {
+        return;
+    }
+
+    const char* p = reinterpret_cast<const char*>(b->records);
+    size_t size = b->count * sizeof(record_s);
+    while (size) {
+        ssize_t n = write(record_fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        p += n;
+        size -= n;
+    }
+    b->count = 0;
+}
+
+// Called by pthreads on thread exit
+static void buffer_destructor(void* b) {
+    in_recorder = true;
+    flush_buffer(static_cast<record_buffer_s*>(b));
+    in_recorder = false;
+}
+
+__attribute__((constructor)) static void init_recorder() {
+    in_recorder = true;
+
+    real_malloc = reinterpret_cast<malloc_fn>(dlsym(RTLD_NEXT, "malloc"));
+    real_free = reinterpret_cast<free_fn>(dlsym(RTLD_NEXT, "free"));
+    real_calloc = reinterpret_cast<calloc_fn>(dlsym(RTLD_NEXT, "calloc"));
+    real_realloc = reinterpret_cast<realloc_fn>(dlsym(RTLD_NEXT, "realloc"));
+    real_posix_memalign = reinterpret_cast<posix_memalign_fn>(dlsym(RTLD_NEXT, "posix_memalign"));
+    real_aligned_alloc = reinterpret_cast<aligned_alloc_fn>(dlsym(RTLD_NEXT, "aligned_alloc"));
+    real_memalign = reinterpret_cast<aligned_alloc_fn>(dlsym(RTLD_NEXT, "memalign"));
+
+    const char* path = getenv("ERIKMT_RECORD_FILE");
+    record_fd = open(path ? path : "erikmt.rec", O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (record_fd >= 0) {
+        record_file_header_s header;
+        memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+        header.version = RECORD_VERSION;
+        header.record_size = sizeof(record_s);
+        if (write(record_fd, &header, sizeof(header)) != sizeof(header)) {
+            close(record_fd);
+            record_fd = -1;
+        }
+    }
+
+    pthread_key_create(&buffer_key, buffer_destructor);
+    in_recorder = false;
+}
+
+__attribute__((destructor)) static void flush_all() {
+    in_recorder = true;
+    for (record_buffer_s* b = buffers.load(std::memory_order_acquire); b; b = b->next) {
+        flush_buffer(b);
+    }
+}
+
+static record_buffer_s* get_buffer() {
+    if (buffer) {
+        return buffer;
+    }
+
+    void* ptr = mmap(NULL, sizeof(record_buffer_s), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return nullptr;
+    }
+
+    buffer = static_cast<record_buffer_s*>(ptr);
+    buffer->thread = gettid();
+
+    record_buffer_s* head = buffers.load(std::memory_order_relaxed);
+    do {
+        buffer->next = head;
+    } while (!buffers.compare_exchange_weak(head, buffer, std::memory_order_release, std::memory_order_relaxed));
+
+    pthread_setspecific(buffer_key, buffer);
+    return buffer;
+}
+
+static void record(record_op op, void* address, uint64_t argument, size_t size) {
+    if (in_recorder || record_fd < 0) {
+        return;
+    }
+    in_recorder = true;
+
+    record_buffer_s* b = get_buffer();
+    if (b) {
+        record_s* r = &b->records[b->count++];
+        r->sequence = sequence.fetch_add(1, std::memory_order_relaxed);
+        r->address = reinterpret_cast<uintptr_t>(address);
+        r->argument = argument;
+        r->size = size;
+        r->thread = b->thread;
+        r->op = op;
+
+        if (b->count == RECORD_BUFFER_RECORDS) {
+            flush_buffer(b);
+        }
+    }
+
+    in_recorder = false;
+}
+
+extern "C" {
+
+void* malloc(size_t size) noexcept {
+    if (!real_malloc) {
+        return bootstrap_alloc(size);
+    }
+
+    void* ptr = real_malloc(size);
+    record(RECORD_MALLOC, ptr, 0, size);
+    return ptr;
+}
+
+void free(void* ptr) noexcept {
+    if (!ptr || is_bootstrap(ptr)) {
+        return;
+    }
+
+    record(RECORD_FREE, ptr, 0, 0);
+    real_free(ptr);
+}
+
+void* calloc(size_t count, size_t size) noexcept {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    if (!real_calloc) {
+        // Static memory starts out zeroed
+        return bootstrap_alloc(total);
+    }
+
+    void* ptr = real_calloc(count, size);
+    record(RECORD_CALLOC, ptr, 0, total);
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) noexcept {
+    if (is_bootstrap(ptr)) {
+        void* moved = malloc(size);
+        size_t available = bootstrap_arena + sizeof(bootstrap_arena) - static_cast<char*>(ptr);
+        if (moved) {
+            memcpy(moved, ptr, (size < available) ? size : available);
+        }
+        return moved;
+    }
+
+    void* moved = real_realloc(ptr, size);
+    record(RECORD_REALLOC, moved, reinterpret_cast<uintptr_t>(ptr), size);
+    return moved;
+}
+
+int posix_memalign(void** out, size_t alignment, size_t size) noexcept {
+    int ret = real_posix_memalign(out, alignment, size);
+    if (ret == 0) {
+        record(RECORD_MEMALIGN, *out, alignment, size);
+    }
+    return ret;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept {
+    void* ptr = real_aligned_alloc(alignment, size);
+    record(RECORD_MEMALIGN, ptr, alignment, size);
+    return ptr;
+}
+
+void* memalign(size_t alignment, size_t size) noexcept {
+    void* ptr = real_memalign(alignment, size);
+    record(RECORD_MEMALIGN, ptr, alignment, size);
+    return ptr;
+}
+
+}
@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sched.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "bench_utils.h"
+#include "record.h"
+
+// Replays a recording made with librecord.so against glibc malloc and
+// erikmtalloc, each in a child process of its own, and reports throughput,
+// peak RSS, fragmentation (peak RSS over peak live bytes) and per operation
+// latency percentiles.  Every recorded thread is replayed on a thread of its
+// own; a free or realloc of a block allocated by another thread waits until
+// that thread has replayed the allocation.
+//
+// Usage: replay_bench <recording> [glibc|erikmtalloc]
+
+// An allocation's lifetime is a slot, filled by the operation that allocates
+// it and emptied by the one that frees it
+struct replay_op_s {
+    uint8_t op;
+    uint32_t slot;
+    uint32_t old_slot; // realloc() only
+    uint64_t size;
+    uint64_t alignment;
+};
+
+typedef struct replay_op_s replay_op_s;
+
+// Marks a slot whose allocation failed, so the free is skipped
+static void* const FAILED = reinterpret_cast<void*>(1);
+
+struct recording_s {
+    std::vector<std::vector<replay_op_s>> threads;
+    uint32_t slot_count = 0;
+    uint64_t peak_live = 0;
+};
+
+static bool load_recording(const char* path, recording_s* recording) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+
+    record_file_header_s header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, RECORD_MAGIC, sizeof(header.magic)) ||
+        header.version != RECORD_VERSION || header.record_size != sizeof(record_s)) {
+        fprintf(stderr, "%s: not an erikmtalloc recording\n", path);
+        fclose(file);
+        return false;
+    }
+
+    std::vector<record_s> records;
+    record_s record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        records.push_back(record);
+    }
+    fclose(file);
+
+    std::sort(records.begin(), records.end(), [](const record_s& a, const record_s& b) {
+        return a.sequence < b.sequence;
+    });
+
+    // Live address -> slot and size, to turn addresses into slots
+    std::unordered_map<uint64_t, std::pair<uint32_t, uint64_t>> live;
+    std::unordered_map<uint32_t, size_t> thread_index;
+    uint64_t live_bytes = 0;
+
+    for (const record_s& r : records) {
+        auto inserted = thread_index.emplace(r.thread, recording->threads.size());
+        if (inserted.second) {
+            recording->threads.emplace_back();
+        }
+        std::vector<replay_op_s>& ops = recording->threads[inserted.first->second];
+
+        replay_op_s op = { r.op, 0, 0, r.size, 0 };
+
+        if (r.op == RECORD_FREE || (r.op == RECORD_REALLOC && r.argument)) {
+            uint64_t old_address = (r.op == RECORD_FREE) ? r.address : r.argument;
+            auto found = live.find(old_address);
+
+            if (found == live.end()) {
+                // Allocated before recording started, replay as a fresh allocation
+                if (r.op == RECORD_FREE) continue;
+                op.op = RECORD_MALLOC;
+            } else {
+                op.old_slot = found->second.first;
+                live_bytes -= found->second.second;
+                live.erase(found);
+            }
+
+            if (r.op == RECORD_FREE) {
+                op.slot = op.old_slot;
+                ops.push_back(op);
+                continue;
+            }
+        } else if (r.op == RECORD_REALLOC) {
+            op.op = RECORD_MALLOC;
+        }
+
+        if (r.op == RECORD_MEMALIGN) {
+            op.alignment = r.argument;
+        }
+
+        if (r.address == 0) {
+            // A failed allocation, or realloc(ptr, 0) freeing ptr
+            if (op.op == RECORD_REALLOC) {
+                op.op = RECORD_FREE;
+                op.slot = op.old_slot;
+                ops.push_back(op);
+            }
+            continue;
+        }
+
+        // The recorder can see an address reused before the realloc() that
+        // released it, treat the stale entry as freed
+        auto stale = live.find(r.address);
+        if (stale != live.end()) {
+            live_bytes -= stale->second.second;
+            live.erase(stale);
+        }
+
+        op.slot = recording->slot_count++;
+        live.emplace(r.address, std::make_pair(op.slot, r.size));
+        live_bytes += r.size;
+        recording->peak_live = std::max(recording->peak_live, live_bytes);
+        ops.push_back(op);
+    }
+
+    return true;
+}
+
+// Write to every page of a new block, as the application would have
+static void touch(void* ptr, size_t size) {
+    char* p = static_cast<char*>(ptr);
+    for (size_t i = 0; i < size; i += 4096) {
+        p[i] = 1;
+    }
+}
+
+static void replay_thread(const allocator_s* a, const std::vector<replay_op_s>& ops,
+    std::vector<std::atomic<void*>>& slots, std::vector<uint32_t>* latencies) {
+    for (size_t i = 0; i < ops.size(); ++i) {
+        const replay_op_s& op = ops[i];
+        void* old_ptr = nullptr;
+        if (op.op == RECORD_FREE || op.op == RECORD_REALLOC) {
+            // Wait for the thread that allocated it
+            while (!(old_ptr = slots[op.old_slot].load(std::memory_order_acquire))) {
+                sched_yield();
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        void* ptr = nullptr;
+        switch (op.op) {
+        case RECORD_MALLOC:
+            ptr = a->malloc(op.size);
+            break;
+        case RECORD_CALLOC:
+            ptr = a->calloc(1, op.size);
+            break;
+        case RECORD_MEMALIGN:
+            ptr = a->aligned_alloc(op.alignment, op.size);
+            break;
+        case RECORD_REALLOC:
+            ptr = a->realloc((old_ptr == FAILED) ? nullptr : old_ptr, op.size);
+            break;
+        case RECORD_FREE:
+            if (old_ptr != FAILED) a->free(old_ptr);
+            break;
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        (*latencies)[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+        if (op.op != RECORD_FREE) {
+            if (ptr) touch(ptr, op.size);
+            slots[op.slot].store(ptr ? ptr : FAILED, std::memory_order_release);
+        }
+    }
+}
+
+static void run(const allocator_s* a, const recording_s& recording) {
+    std::vector<std::atomic<void*>> slots(recording.slot_count);
+    size_t thread_count = recording.threads.size();
+    // Filled in before the baseline, so they don't count towards peak RSS
+    std::vector<std::vector<uint32_t>> latencies(thread_count);
+    size_t total_ops = 0;
+
+    for (size_t t = 0; t < thread_count; ++t) {
+        latencies[t].resize(recording.threads[t].size());
+        total_ops += recording.threads[t].size();
+    }
+
+    long baseline_kb = reset_peak_rss_kb();
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < thread_count; ++t) {
+        workers.emplace_back(replay_thread, a, std::cref(recording.threads[t]), std::ref(slots), &latencies[t]);
+    }
+    for (std::thread& worker : workers) worker.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    long peak_kb = read_status_kb("VmHWM:") - baseline_kb;
+
+    printf("%-12s %zu ops on %zu threads in %.3f s, %.2f Mops/s, peak RSS %.1f MB, fragmentation %.2f\n",
+        a->name, total_ops, thread_count, elapsed.count(), total_ops / elapsed.count() / 1e6, peak_kb / 1024.0,
+        recording.peak_live ? peak_kb * 1024.0 / recording.peak_live : 0.0);
+
+    static const char* op_names[] = { "malloc", "calloc", "memalign", "realloc", "free" };
+    for (size_t op = 0; op < 5; ++op) {
+        std::vector<uint32_t> all;
+        for (size_t t = 0; t < thread_count; ++t) {
+            for (size_t i = 0; i < latencies[t].size(); ++i) {
+                if (recording.threads[t][i].op == op) all.push_back(latencies[t][i]);
+            }
+        }
+        if (all.empty()) continue;
+
+        printf("%-12s   %-8s %10zu ops  p50 %6u ns  p99 %6u ns  p99.9 %6u ns\n", "", op_names[op], all.size(),
+            percentile(all, 0.5), percentile(all, 0.99), percentile(all, 0.999));
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <recording> [glibc|erikmtalloc]\n", argv[0]);
+        return 2;
+    }
+
+    recording_s recording;
+    if (!load_recording(argv[1], &recording)) {
+        return 1;
+    }
+    printf("%s: %u allocations, peak live %.1f MB\n", argv[1], recording.slot_count, recording.peak_live / 1048576.0);
+    fflush(stdout);
+
+    for (const allocator_s& a : allocators) {
+        if (argc == 3 && strcmp(argv[2], a.name) != 0) {
+            continue;
+        }
+
+        if (!run_in_child([&] { run(&a, recording); })) {
+            fprintf(stderr, "%s replay failed\n", a.name);
+            return 1;
+        }
+    }
+    return 0;
+}
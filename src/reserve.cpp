@@ -0,0 +1,221 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sys/mman.h>
+
+#include "erikmtalloc_internal.h"
+#include "reserve.h"
+#include "stats.h"
+#include "utils.h"
+
+// Chunks are carved with a bump pointer out of one large PROT_NONE,
+// MAP_NORESERVE range reserved on first use, instead of an mmap() each.  The
+// range is made accessible RESERVE_COMMIT_STEP bytes at a time with
+// mprotect(), so most new chunks cost no syscall at all, and chunks sit next
+// to each other in address order.  Chunks evicted from the chunk cache have
+// their pages dropped, are merged with free neighbours, and are handed out
+// again for the same size, or split up once the range is used up.  If the
+// range can't be reserved (e.g. under a tight ulimit -v), or once it's used
+// up and no free extent fits, chunks are mmap()ed one by one as before.
+struct free_extent_s {
+    char* ptr;
+    size_t size;
+};
+
+// Header written over a free extent that didn't fit in free_extents
+struct spilled_extent_s {
+    spilled_extent_s* next;
+    size_t size;
+};
+
+typedef struct free_extent_s free_extent_s;
+typedef struct spilled_extent_s spilled_extent_s;
+
+// All of these must hold reserve_mut, which is taken last of all the
+// allocator's locks.  mprotect() runs under it, once per commit step.
+static std::mutex reserve_mut;
+static char* reserve_base;
+static char* reserve_end;
+static char* carved; // Bytes below have been handed out
+static char* committed; // Bytes below are readable and writable
+static free_extent_s free_extents[RESERVE_FREE_SLOTS];
+static unsigned int free_count;
+static spilled_extent_s* spilled;
+
+// Reserve the range, halving its size until the kernel agrees.  The base is
+// aligned to RESERVE_COMMIT_STEP, which is also the huge page size.
+static bool reserve_range() {
+    static bool tried = false;
+    if (tried) {
+        return reserve_base != nullptr;
+    }
+    tried = true;
+
+    for (size_t size = RESERVE_SIZE; size >= RESERVE_MIN_SIZE; size /= 2) {
+        void* ptr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ptr == MAP_FAILED) {
+            continue;
+        }
+
+        uintptr_t aligned = (reinterpret_cast<uintptr_t>(ptr) + RESERVE_COMMIT_STEP - 1) & ~static_cast<uintptr_t>(RESERVE_COMMIT_STEP - 1);
+        reserve_base = reinterpret_cast<char*>(aligned);
+        reserve_end = static_cast<char*>(ptr) + size;
+        carved = reserve_base;
+        committed = reserve_base;
+
+        debug(std::cout, "Reserved", size, "bytes of address space at", static_cast<void*>(reserve_base));
+        return true;
+    }
+
+    debug(std::cout, "Couldn't reserve address space, mapping chunks one by one");
+    return false;
+}
+
+// Make sure everything below end is accessible
+static bool commit_to(char* end) {
+    if (end <= committed) {
+        return true;
+    }
+
+    size_t step = (end - committed + RESERVE_COMMIT_STEP - 1) & ~static_cast<size_t>(RESERVE_COMMIT_STEP - 1);
+    if (step > static_cast<size_t>(reserve_end - committed)) {
+        step = reserve_end - committed;
+    }
+
+    if (mprotect(committed, step, PROT_READ | PROT_WRITE) != 0) {
+        debug(std::cout, "mprotect() failed committing", step, "bytes");
+        return false;
+    }
+    committed += step;
+    return true;
+}
+
+// Remember a free extent whose pages were dropped, merging it with the free
+// extents on either side, or moving the bump pointer back if it ends there.
+// Once every slot is taken, the extent is linked through its own first page
+// instead of being lost.  Must hold reserve_mut.
+static void add_free_extent(char* ptr, size_t size) {
+    for (unsigned int i = 0; i < free_count;) {
+        free_extent_s* extent = &free_extents[i];
+        if (extent->ptr + extent->size == ptr || ptr + size == extent->ptr) {
+            ptr = (extent->ptr < ptr) ? extent->ptr : ptr;
+            size += extent->size;
+            *extent = free_extents[--free_count];
+            continue;
+        }
+        ++i;
+    }
+
+    if (ptr + size == carved) {
+        carved = ptr;
+        return;
+    }
+    if (free_count < RESERVE_FREE_SLOTS) {
+        free_extents[free_count++] = { ptr, size };
+        return;
+    }
+
+    spilled_extent_s* extent = reinterpret_cast<spilled_extent_s*>(ptr);
+    extent->next = spilled;
+    extent->size = size;
+    spilled = extent;
+}
+
+static bool fits(char* ptr, size_t extent_size, size_t size, size_t alignment, bool exact) {
+    return (exact ? extent_size == size : extent_size >= size) && reinterpret_cast<uintptr_t>(ptr) % alignment == 0;
+}
+
+// Take size bytes off the front of a free extent that fits, preferring an
+// extent of exactly that size.  Must hold reserve_mut.
+static char* take_free_extent(size_t size, size_t alignment, bool exact) {
+    for (unsigned int i = free_count; i-- > 0;) {
+        free_extent_s* extent = &free_extents[i];
+        if (fits(extent->ptr, extent->size, size, alignment, exact)) {
+            char* ptr = extent->ptr;
+            extent->ptr += size;
+            extent->size -= size;
+            if (!extent->size) {
+                *extent = free_extents[--free_count];
+            }
+            return ptr;
+        }
+    }
+
+    for (spilled_extent_s** link = &spilled; *link; link = &(*link)->next) {
+        spilled_extent_s* extent = *link;
+        char* ptr = reinterpret_cast<char*>(extent);
+        size_t extent_size = extent->size;
+        if (fits(ptr, extent_size, size, alignment, exact)) {
+            *link = extent->next;
+            if (extent_size > size) {
+                add_free_extent(ptr + size, extent_size - size);
+            }
+            // Handed out zeroed, like the rest of the dropped pages
+            memset(ptr, 0, sizeof(spilled_extent_s));
+            return ptr;
+        }
+    }
+    return nullptr;
+}
+
+// Hand out size bytes (a multiple of the page size) aligned to alignment (a
+// power of two, at least a page) from the reservation.  Returns nullptr if
+// the reservation is unavailable or used up.
+char* reserve_map(size_t size, size_t alignment) {
+    std::unique_lock<std::mutex> reserve_lock(reserve_mut);
+
+    if (!reserve_range()) {
+        return nullptr;
+    }
+
+    char* ptr = take_free_extent(size, alignment, true);
+    if (!ptr) {
+        uintptr_t start = (reinterpret_cast<uintptr_t>(carved) + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+        ptr = reinterpret_cast<char*>(start);
+        if (ptr <= reserve_end && size <= static_cast<size_t>(reserve_end - ptr) && commit_to(ptr + size)) {
+            carved = ptr + size;
+        } else {
+            // Used up, split a larger free extent instead
+            ptr = take_free_extent(size, alignment, false);
+        }
+    }
+    if (!ptr) {
+        return nullptr;
+    }
+
+    // Counts toward the mapped bytes, without an mmap() call
+    stats_record_remap(0, size);
+    return ptr;
+}
+
+// Take back a chunk handed out by reserve_map(), dropping its pages.
+// Returns false if ptr isn't part of the reservation.
+bool reserve_unmap(char* ptr, size_t size) {
+    {
+        std::unique_lock<std::mutex> reserve_lock(reserve_mut);
+        if (ptr < reserve_base || ptr >= reserve_end) {
+            return false;
+        }
+    }
+
+    debug(std::cout, "Releasing reserved chunk", static_cast<void*>(ptr), "with size:", size, "bytes");
+
+    // Nobody else can see the chunk anymore, so its pages are dropped unlocked
+    madvise(ptr, size, MADV_DONTNEED);
+    stats_record_purge(size);
+    stats_record_remap(size, 0);
+
+    std::unique_lock<std::mutex> reserve_lock(reserve_mut);
+    add_free_extent(ptr, size);
+    return true;
+}
+
+void reserve_lock_all() {
+    reserve_mut.lock();
+}
+
+void reserve_unlock_all() {
+    reserve_mut.unlock();
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+
+#define RESERVE_SIZE (1ULL << 36) // 64GB of address space reserved for chunks up front
+#define RESERVE_MIN_SIZE (1ULL << 30) // Smallest reservation tried before giving up on it
+#define RESERVE_COMMIT_STEP (2 * 1024 * 1024) // Made accessible 2MB at a time
+#define RESERVE_FREE_SLOTS 64 // Released chunks remembered for reuse
+
+char* reserve_map(size_t size, size_t alignment);
+bool reserve_unmap(char* ptr, size_t size);
+void reserve_lock_all();
+void reserve_unlock_all();
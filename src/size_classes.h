@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+
+// Size classes shared by the allocation front-ends.  Requests up to 128 bytes
+// are rounded to 16 byte steps, larger requests get four classes per power of
+// two (160, 192, 224, 256, 320, ...) up to MAX_CACHED_SIZE.
+#define SIZE_CLASS_STEP 16
+#define SIZE_CLASS_SMALL_MAX 128
+#define SIZE_CLASS_SMALL_COUNT (SIZE_CLASS_SMALL_MAX / SIZE_CLASS_STEP)
+#define MAX_CACHED_SIZE 1024*32 // 32KB, larger requests bypass the size classes
+#define SIZE_CLASS_COUNT 40
+#define MIN_ALIGNMENT 16 // Every allocation is at least 16 byte aligned
+#define CACHE_REFILL_BYTES 1024*16 // Refill/flush roughly 16KB worth of blocks per batch
+#define CACHE_MIN_BATCH 2
+#define CACHE_MAX_BATCH 32
+
+// Map a request size to its size class index
+constexpr size_t size_class_index(size_t size) {
+    if (size <= SIZE_CLASS_SMALL_MAX) {
+        return (size == 0) ? 0 : (size + SIZE_CLASS_STEP - 1) / SIZE_CLASS_STEP - 1;
+    }
+
+    size_t s = size - 1;
+    size_t lg = 63 - __builtin_clzl(s);
+
+    return SIZE_CLASS_SMALL_COUNT + (lg - 7) * 4 + ((s >> (lg - 2)) - 4);
+}
+
+// Map a size class index back to the (rounded up) size it serves
+constexpr size_t size_class_size(size_t index) {
+    if (index < SIZE_CLASS_SMALL_COUNT) {
+        return (index + 1) * SIZE_CLASS_STEP;
+    }
+
+    size_t k = index - SIZE_CLASS_SMALL_COUNT;
+    size_t lg = 7 + k / 4;
+
+    return ((k % 4) + 5) << (lg - 2);
+}
+
+// Smallest class size that holds size bytes and is a multiple of alignment
+// (a power of two no larger than the largest small class step)
+constexpr size_t aligned_class_size(size_t size, size_t alignment) {
+    size_t index = size_class_index(size < alignment ? alignment : size);
+
+    while (size_class_size(index) % alignment) {
+        ++index;
+    }
+    return size_class_size(index);
+}
+
+// Number of blocks moved between a cache (thread or CPU) and the shared heap at once
+constexpr unsigned int size_class_batch(size_t index) {
+    size_t count = CACHE_REFILL_BYTES / size_class_size(index);
+
+    if (count < CACHE_MIN_BATCH) return CACHE_MIN_BATCH;
+    if (count > CACHE_MAX_BATCH) return CACHE_MAX_BATCH;
+    return static_cast<unsigned int>(count);
+}
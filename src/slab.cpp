@@ -0,0 +1,308 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sys/mman.h>
+
+#include "chunk_cache.h"
+#include "erikmtalloc.h"
+#include "erikmtalloc_internal.h"
+#include "pagemap.h"
+#include "size_classes.h"
+#include "slab.h"
+#include "utils.h"
+
+#define SLAB_CLASS_COUNT (size_class_index(SLAB_MAX_SIZE) + 1)
+// Enough bitmap words for a full chunk of the smallest size class
+#define SLAB_BITMAP_WORDS (DEFAULT_CHUNK_SIZE / SIZE_CLASS_STEP / 64)
+#define SLAB_SUMMARY_WORDS (SLAB_BITMAP_WORDS / 64)
+
+// A chunk dedicated to a single size class, carved into equal size slots.
+// Free slots are tracked with one bit each in bitmap, and summary keeps one
+// bit per bitmap word that still has a free slot, so finding a free slot is
+// at most a couple of word scans regardless of how full the slab is.
+struct slab_s {
+    slab_s* next_partial;   // Slabs of this class with free slots
+    slab_s* prev_partial;
+    char* start;            // First slot
+    char* end;              // One past the last slot
+    size_t block_size;
+    size_t size_class;
+    size_t capacity;
+    size_t free_count;
+    bool is_partial;
+    uint64_t summary[SLAB_SUMMARY_WORDS];
+    uint64_t bitmap[SLAB_BITMAP_WORDS];
+};
+
+typedef struct slab_s slab_s;
+
+// Each size class has its own lock, so threads allocating and freeing
+// different sizes never contend.  Taken after mut and before the chunk cache
+// lock.
+static std::mutex class_locks[SLAB_CLASS_COUNT];
+
+// Per hint and size class list of slabs with at least one free slot, must
+// hold the class lock.  Hinted slots never share a slab with other hints.
+static slab_s* partial_slabs[ERIKMT_HINT_COUNT][SLAB_CLASS_COUNT];
+
+static chunk_s* get_slab_chunk(slab_s* slab) {
+    return reinterpret_cast<chunk_s*>(reinterpret_cast<char*>(slab) - sizeof(chunk_s));
+}
+
+// The slab header lives right after the chunk header
+static slab_s* get_slab(chunk_s* chunk) {
+    return reinterpret_cast<slab_s*>(reinterpret_cast<char*>(chunk) + sizeof(chunk_s));
+}
+
+static slab_s*& get_partial_list(slab_s* slab) {
+    return partial_slabs[get_slab_chunk(slab)->hint][slab->size_class];
+}
+
+static void push_partial(slab_s* slab) {
+    slab->prev_partial = nullptr;
+    slab->next_partial = get_partial_list(slab);
+    if (slab->next_partial) {
+        slab->next_partial->prev_partial = slab;
+    }
+    get_partial_list(slab) = slab;
+    slab->is_partial = true;
+}
+
+static void remove_partial(slab_s* slab) {
+    if (slab->prev_partial) {
+        slab->prev_partial->next_partial = slab->next_partial;
+    } else {
+        get_partial_list(slab) = slab->next_partial;
+    }
+    if (slab->next_partial) {
+        slab->next_partial->prev_partial = slab->prev_partial;
+    }
+    slab->next_partial = nullptr;
+    slab->prev_partial = nullptr;
+    slab->is_partial = false;
+}
+
+// mmap a chunk for the size class, lay out its slots and mark them all free.
+// Nobody else can see the slab until it's pushed on the partial list, so
+// this runs without the class lock.
+static slab_s* create_slab(size_t size_class, erikmt_hint hint) {
+    char* ptr = chunk_cache_map(DEFAULT_CHUNK_SIZE);
+    if (!ptr) {
+        return nullptr;
+    }
+
+    chunk_s* chunk = reinterpret_cast<chunk_s*>(ptr);
+    chunk->next = nullptr;
+    chunk->allocated_size = DEFAULT_CHUNK_SIZE;
+    chunk->remaining_size = 0;
+    chunk->is_allocated = true;
+    chunk->is_footer = false;
+    chunk->is_parent = true;
+    chunk->is_slab = true;
+    chunk->is_huge = false;
+    chunk->hint = hint;
+    chunk->total_allocations = 0;
+
+    slab_s* slab = get_slab(chunk);
+    uintptr_t start = reinterpret_cast<uintptr_t>(slab) + sizeof(slab_s);
+    start = (start + SLAB_SLOT_ALIGNMENT - 1) & ~static_cast<uintptr_t>(SLAB_SLOT_ALIGNMENT - 1);
+
+    slab->block_size = size_class_size(size_class);
+    slab->size_class = size_class;
+    slab->start = reinterpret_cast<char*>(start);
+    slab->capacity = (ptr + DEFAULT_CHUNK_SIZE - slab->start) / slab->block_size;
+    slab->end = slab->start + slab->capacity * slab->block_size;
+    slab->free_count = slab->capacity;
+
+    // The chunk may be reused from the chunk cache, so clear the bitmaps
+    memset(slab->summary, 0, sizeof(slab->summary));
+    memset(slab->bitmap, 0, sizeof(slab->bitmap));
+    for (size_t i = 0; i < slab->capacity / 64; ++i) {
+        slab->bitmap[i] = ~0ULL;
+    }
+    if (slab->capacity % 64) {
+        slab->bitmap[slab->capacity / 64] = (1ULL << (slab->capacity % 64)) - 1;
+    }
+    size_t words = (slab->capacity + 63) / 64;
+    for (size_t i = 0; i < words / 64; ++i) {
+        slab->summary[i] = ~0ULL;
+    }
+    if (words % 64) {
+        slab->summary[words / 64] = (1ULL << (words % 64)) - 1;
+    }
+
+    debug(std::cout, "Created slab", slab, "for size class", slab->block_size, "with", slab->capacity, "slots");
+
+    pagemap_register(chunk, DEFAULT_CHUNK_SIZE, chunk);
+
+    return slab;
+}
+
+// First slab of the size class and hint with a free slot, creating one if
+// there is none.  The class lock is dropped while the new chunk is mapped.
+static slab_s* get_partial_slab(size_t size_class, erikmt_hint hint, std::unique_lock<std::mutex>& class_lock) {
+    slab_s* slab = partial_slabs[hint][size_class];
+    if (slab) {
+        return slab;
+    }
+
+    class_lock.unlock();
+    slab = create_slab(size_class, hint);
+    class_lock.lock();
+
+    if (slab) {
+        push_partial(slab);
+    }
+    return slab;
+}
+
+// Reserve a slot in the first partial slab of the size class and hint
+void* slab_alloc(size_t size, erikmt_hint hint) {
+    size_t size_class = size_class_index(size);
+    std::unique_lock<std::mutex> class_lock(class_locks[size_class]);
+    slab_s* slab = get_partial_slab(size_class, hint, class_lock);
+
+    if (!slab) {
+        return nullptr;
+    }
+
+    size_t summary_index = 0;
+    while (slab->summary[summary_index] == 0) {
+        ++summary_index;
+    }
+
+    size_t word = summary_index * 64 + __builtin_ctzll(slab->summary[summary_index]);
+    size_t bit = __builtin_ctzll(slab->bitmap[word]);
+
+    slab->bitmap[word] &= ~(1ULL << bit);
+    if (slab->bitmap[word] == 0) {
+        slab->summary[summary_index] &= ~(1ULL << (word % 64));
+    }
+
+    slab->free_count -= 1;
+    get_slab_chunk(slab)->total_allocations += 1;
+    if (slab->free_count == 0) {
+        remove_partial(slab);
+    }
+
+    return slab->start + (word * 64 + bit) * slab->block_size;
+}
+
+// Reserve up to count slots of the size class under one acquisition of the
+// class lock.  Free slots are taken a bitmap word at a time, so they come in
+// runs of adjacent slots from the same slab.  Returns how many were reserved.
+size_t slab_alloc_batch(size_t size, size_t count, void** out) {
+    size_t size_class = size_class_index(size);
+    size_t n = 0;
+    std::unique_lock<std::mutex> class_lock(class_locks[size_class]);
+
+    while (n < count) {
+        slab_s* slab = get_partial_slab(size_class, ERIKMT_HINT_NONE, class_lock);
+        if (!slab) {
+            break;
+        }
+
+        size_t taken = 0;
+        size_t summary_index = 0;
+        while (n < count && taken < slab->free_count) {
+            while (slab->summary[summary_index] == 0) {
+                ++summary_index;
+            }
+
+            size_t word = summary_index * 64 + __builtin_ctzll(slab->summary[summary_index]);
+            uint64_t bits = slab->bitmap[word];
+            char* base = slab->start + word * 64 * slab->block_size;
+
+            while (bits && n < count) {
+                out[n++] = base + __builtin_ctzll(bits) * slab->block_size;
+                bits &= bits - 1;
+                ++taken;
+            }
+
+            slab->bitmap[word] = bits;
+            if (bits == 0) {
+                slab->summary[summary_index] &= ~(1ULL << (word % 64));
+            }
+        }
+
+        slab->free_count -= taken;
+        get_slab_chunk(slab)->total_allocations += taken;
+        if (slab->free_count == 0) {
+            remove_partial(slab);
+        }
+    }
+
+    return n;
+}
+
+// Release a slot back to the slab chunk that owns it, must hold
+// slab_lock(chunk).  Once
+// a slab is completely free it's unmapped, unless it's the only slab of its
+// size class and hint with free slots left.
+void slab_free(chunk_s* chunk, void* ptr) {
+    slab_s* slab = get_slab(chunk);
+    char* p = static_cast<char*>(ptr);
+    size_t offset = p - slab->start;
+
+    if (p < slab->start || p >= slab->end || offset % slab->block_size) {
+        debug(std::cout, "Ignoring free of invalid slab pointer", ptr);
+        return;
+    }
+
+    size_t slot = offset / slab->block_size;
+    size_t word = slot / 64;
+
+    slab->bitmap[word] |= 1ULL << (slot % 64);
+    slab->summary[word / 64] |= 1ULL << (word % 64);
+
+    slab->free_count += 1;
+    get_slab_chunk(slab)->total_allocations -= 1;
+    if (!slab->is_partial) {
+        push_partial(slab);
+    }
+
+    if (slab->free_count == slab->capacity && (slab->prev_partial || slab->next_partial)) {
+        debug(std::cout, "Slab", slab, "is empty, releasing chunk space");
+        remove_partial(slab);
+        pagemap_unregister(chunk, chunk->allocated_size);
+        chunk_cache_unmap(reinterpret_cast<char*>(chunk), chunk->allocated_size);
+    }
+}
+
+// The lock of the slab's size class
+std::mutex& slab_lock(chunk_s* chunk) {
+    return class_locks[get_slab(chunk)->size_class];
+}
+
+// Hold every size class lock across fork()
+void slab_lock_all() {
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; ++i) {
+        class_locks[i].lock();
+    }
+}
+
+void slab_unlock_all() {
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; ++i) {
+        class_locks[i].unlock();
+    }
+}
+
+// Return the slot size of the slab chunk
+size_t slab_block_size(chunk_s* chunk) {
+    return get_slab(chunk)->block_size;
+}
+
+void print_slab(chunk_s* chunk) {
+    slab_s* slab = get_slab(chunk);
+
+    std::cout << std::boolalpha
+        << "SLAB: " << slab
+        << " BLOCK SIZE: " << slab->block_size
+        << " CAPACITY: " << slab->capacity
+        << " FREE: " << slab->free_count
+        << " HINT: " << static_cast<int>(chunk->hint)
+        << " IS_PARTIAL: " << slab->is_partial
+        << std::endl;
+}
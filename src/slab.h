@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+
+#include "erikmtalloc.h"
+#include "erikmtalloc_internal.h"
+
+#define SLAB_MAX_SIZE 1024 // Requests up to 1KB are served from size class slabs
+#define SLAB_SLOT_ALIGNMENT 64 // First slot starts on a cache line
+
+void* slab_alloc(size_t size, erikmt_hint hint);
+size_t slab_alloc_batch(size_t size, size_t count, void** out);
+void slab_free(chunk_s* chunk, void* ptr);
+std::mutex& slab_lock(chunk_s* chunk);
+void slab_lock_all();
+void slab_unlock_all();
+size_t slab_block_size(chunk_s* chunk);
+void print_slab(chunk_s* chunk);
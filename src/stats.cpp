@@ -0,0 +1,310 @@
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+
+#include "size_classes.h"
+#include "stats.h"
+
+// Allocation and free counts are bumped on every call, so each thread keeps
+// its own: only the owning thread writes them, with plain loads and stores
+// instead of locked instructions, and readers sum them over every live
+// thread.  A thread's counts are folded into exited_counters when it exits.
+// Everything else changes on mmap()/munmap()/madvise() or under contention,
+// which is rare enough for plain shared counters.
+struct stats_counters_s {
+    std::atomic<uint64_t> class_allocations[SIZE_CLASS_COUNT];
+    std::atomic<uint64_t> class_frees[SIZE_CLASS_COUNT];
+    std::atomic<uint64_t> large_allocations;
+    std::atomic<uint64_t> large_frees;
+    std::atomic<uint64_t> large_bytes_allocated;
+    std::atomic<uint64_t> large_bytes_freed;
+};
+
+// Kept trivially constructible, like the thread cache, so that touching it
+// never allocates
+struct thread_stats_s {
+    stats_counters_s counters;
+    thread_stats_s* prev;
+    thread_stats_s* next;
+    bool registered;
+    bool torn_down;
+};
+
+typedef struct stats_counters_s stats_counters_s;
+typedef struct thread_stats_s thread_stats_s;
+
+static thread_local thread_stats_s thread_stats __attribute__((tls_model("initial-exec")));
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+// Live threads' counters, guarded by threads_lock
+static thread_stats_s* threads;
+static std::atomic_flag threads_lock = ATOMIC_FLAG_INIT;
+
+// Counts of exited threads, and of frees made while a thread is exiting
+static stats_counters_s exited_counters;
+
+static std::atomic<uint64_t> bytes_mapped;
+static std::atomic<uint64_t> bytes_retained;
+static std::atomic<uint64_t> bytes_purged;
+static std::atomic<uint64_t> mmap_calls;
+static std::atomic<uint64_t> munmap_calls;
+static std::atomic<uint64_t> lock_contentions;
+
+static void lock_threads() {
+    while (threads_lock.test_and_set(std::memory_order_acquire)) {
+        sched_yield();
+    }
+}
+
+static void unlock_threads() {
+    threads_lock.clear(std::memory_order_release);
+}
+
+// Hold threads_lock across fork(), threads start and exit while others fork
+void stats_lock_all() {
+    lock_threads();
+}
+
+void stats_unlock_all() {
+    unlock_threads();
+}
+
+static void add_counters(stats_counters_s* to, stats_counters_s* from) {
+    for (size_t i = 0; i < SIZE_CLASS_COUNT; ++i) {
+        to->class_allocations[i].fetch_add(from->class_allocations[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        to->class_frees[i].fetch_add(from->class_frees[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    to->large_allocations.fetch_add(from->large_allocations.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    to->large_frees.fetch_add(from->large_frees.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    to->large_bytes_allocated.fetch_add(from->large_bytes_allocated.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    to->large_bytes_freed.fetch_add(from->large_bytes_freed.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+// Called by pthreads on thread exit, folds the thread's counts into the totals
+static void stats_destructor(void*) {
+    lock_threads();
+    if (thread_stats.prev) {
+        thread_stats.prev->next = thread_stats.next;
+    } else {
+        threads = thread_stats.next;
+    }
+    if (thread_stats.next) {
+        thread_stats.next->prev = thread_stats.prev;
+    }
+    add_counters(&exited_counters, &thread_stats.counters);
+    thread_stats.torn_down = true;
+    unlock_threads();
+}
+
+static void create_stats_key() {
+    pthread_key_create(&stats_key, stats_destructor);
+}
+
+static void register_thread() {
+    // Set first, pthreads may allocate while registering the key
+    thread_stats.registered = true;
+    pthread_once(&stats_key_once, create_stats_key);
+
+    lock_threads();
+    thread_stats.prev = nullptr;
+    thread_stats.next = threads;
+    if (threads) {
+        threads->prev = &thread_stats;
+    }
+    threads = &thread_stats;
+    unlock_threads();
+
+    pthread_setspecific(stats_key, &thread_stats);
+}
+
+// Add n to a counter.  Only the owning thread writes its own counters, so
+// those need no read-modify-write, unlike the shared exited_counters.
+static void bump(std::atomic<uint64_t>* counter, uint64_t n, bool shared) {
+    if (shared) {
+        counter->fetch_add(n, std::memory_order_relaxed);
+        return;
+    }
+    counter->store(counter->load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// The calling thread's counters, or the shared ones once it's exiting
+static stats_counters_s* get_counters() {
+    if (thread_stats.torn_down) {
+        return &exited_counters;
+    }
+    if (!thread_stats.registered) {
+        register_thread();
+    }
+    return &thread_stats.counters;
+}
+
+// Blocks of a class size up to MAX_CACHED_SIZE are counted per class, which
+// is also how the front ends decide whether a freed block can be cached
+static bool is_class_size(size_t size) {
+    return size <= MAX_CACHED_SIZE && size_class_size(size_class_index(size)) == size;
+}
+
+void stats_record_alloc(size_t size) {
+    stats_counters_s* counters = get_counters();
+    bool shared = (counters == &exited_counters);
+
+    if (is_class_size(size)) {
+        bump(&counters->class_allocations[size_class_index(size)], 1, shared);
+        return;
+    }
+    bump(&counters->large_allocations, 1, shared);
+    bump(&counters->large_bytes_allocated, size, shared);
+}
+
+void stats_record_free(size_t size) {
+    stats_counters_s* counters = get_counters();
+    bool shared = (counters == &exited_counters);
+
+    if (is_class_size(size)) {
+        bump(&counters->class_frees[size_class_index(size)], 1, shared);
+        return;
+    }
+    bump(&counters->large_frees, 1, shared);
+    bump(&counters->large_bytes_freed, size, shared);
+}
+
+void stats_record_map(size_t size) {
+    mmap_calls.fetch_add(1, std::memory_order_relaxed);
+    bytes_mapped.fetch_add(size, std::memory_order_relaxed);
+}
+
+void stats_record_unmap(size_t size) {
+    munmap_calls.fetch_add(1, std::memory_order_relaxed);
+    bytes_mapped.fetch_sub(size, std::memory_order_relaxed);
+}
+
+void stats_record_remap(size_t old_size, size_t new_size) {
+    bytes_mapped.fetch_add(new_size - old_size, std::memory_order_relaxed);
+}
+
+void stats_record_retain(size_t size) {
+    bytes_retained.fetch_add(size, std::memory_order_relaxed);
+}
+
+void stats_record_reuse(size_t size) {
+    bytes_retained.fetch_sub(size, std::memory_order_relaxed);
+}
+
+void stats_record_purge(size_t size) {
+    bytes_purged.fetch_add(size, std::memory_order_relaxed);
+}
+
+void stats_record_contention() {
+    lock_contentions.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Fill stats with the current counters.  Doesn't take the heap lock, so the
+// values are read one by one and may be slightly out of sync with each other
+// while other threads allocate.
+void erikmt_get_stats(erikmt_stats_s* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats_counters_s totals{};
+
+    lock_threads();
+    add_counters(&totals, &exited_counters);
+    for (thread_stats_s* thread = threads; thread; thread = thread->next) {
+        add_counters(&totals, &thread->counters);
+    }
+    unlock_threads();
+
+    for (size_t j = 0; j < SIZE_CLASS_COUNT; ++j) {
+        stats->class_allocations[j] = totals.class_allocations[j].load(std::memory_order_relaxed);
+        stats->class_frees[j] = totals.class_frees[j].load(std::memory_order_relaxed);
+    }
+    stats->large_allocations = totals.large_allocations.load(std::memory_order_relaxed);
+    stats->large_frees = totals.large_frees.load(std::memory_order_relaxed);
+    uint64_t large_bytes_allocated = totals.large_bytes_allocated.load(std::memory_order_relaxed);
+    uint64_t large_bytes_freed = totals.large_bytes_freed.load(std::memory_order_relaxed);
+
+    stats->allocations = stats->large_allocations;
+    stats->frees = stats->large_frees;
+    stats->bytes_live = large_bytes_allocated - large_bytes_freed;
+    for (size_t j = 0; j < SIZE_CLASS_COUNT; ++j) {
+        stats->allocations += stats->class_allocations[j];
+        stats->frees += stats->class_frees[j];
+        stats->bytes_live += (stats->class_allocations[j] - stats->class_frees[j]) * size_class_size(j);
+    }
+
+    stats->bytes_mapped = bytes_mapped.load(std::memory_order_relaxed);
+    stats->bytes_retained = bytes_retained.load(std::memory_order_relaxed);
+    stats->bytes_purged = bytes_purged.load(std::memory_order_relaxed);
+    stats->mmap_calls = mmap_calls.load(std::memory_order_relaxed);
+    stats->munmap_calls = munmap_calls.load(std::memory_order_relaxed);
+    stats->lock_contentions = lock_contentions.load(std::memory_order_relaxed);
+}
+
+struct stat_name_s {
+    const char* name;
+    size_t offset;
+};
+
+typedef struct stat_name_s stat_name_s;
+
+static const stat_name_s stat_names[] = {
+    { "bytes.live", offsetof(erikmt_stats_s, bytes_live) },
+    { "bytes.mapped", offsetof(erikmt_stats_s, bytes_mapped) },
+    { "bytes.retained", offsetof(erikmt_stats_s, bytes_retained) },
+    { "bytes.purged", offsetof(erikmt_stats_s, bytes_purged) },
+    { "allocations", offsetof(erikmt_stats_s, allocations) },
+    { "frees", offsetof(erikmt_stats_s, frees) },
+    { "large.allocations", offsetof(erikmt_stats_s, large_allocations) },
+    { "large.frees", offsetof(erikmt_stats_s, large_frees) },
+    { "calls.mmap", offsetof(erikmt_stats_s, mmap_calls) },
+    { "calls.munmap", offsetof(erikmt_stats_s, munmap_calls) },
+    { "lock.contentions", offsetof(erikmt_stats_s, lock_contentions) },
+};
+
+// Read a single counter by name, in the style of mallctl().  Returns 0, or
+// ENOENT for an unknown name.
+int erikmt_stat(const char* name, uint64_t* value) {
+    for (const stat_name_s& stat : stat_names) {
+        if (strcmp(stat.name, name) == 0) {
+            erikmt_stats_s stats;
+            erikmt_get_stats(&stats);
+            *value = *reinterpret_cast<uint64_t*>(reinterpret_cast<char*>(&stats) + stat.offset);
+            return 0;
+        }
+    }
+    return ENOENT;
+}
+
+// Write the counters to buf as a JSON object, without allocating.  Returns
+// the length of the full output like snprintf(), so a return value of size
+// or more means it was truncated.
+size_t erikmt_stats_json(char* buf, size_t size) {
+    erikmt_stats_s stats;
+    erikmt_get_stats(&stats);
+
+    size_t len = 0;
+    auto append = [&](const char* format, auto... args) {
+        int n = snprintf(buf + (len < size ? len : size), len < size ? size - len : 0, format, args...);
+        len += (n > 0) ? n : 0;
+    };
+
+    append("%s", "{");
+    for (const stat_name_s& stat : stat_names) {
+        unsigned long long value = *reinterpret_cast<uint64_t*>(reinterpret_cast<char*>(&stats) + stat.offset);
+        append("\"%s\":%llu,", stat.name, value);
+    }
+
+    append("\"classes\":[");
+    for (size_t j = 0; j < SIZE_CLASS_COUNT; ++j) {
+        append("%s{\"size\":%zu,\"allocations\":%llu,\"frees\":%llu}", j ? "," : "", size_class_size(j),
+            static_cast<unsigned long long>(stats.class_allocations[j]),
+            static_cast<unsigned long long>(stats.class_frees[j]));
+    }
+    append("%s", "]}");
+
+    return len;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "size_classes.h"
+
+// Snapshot of the allocator's counters.  Byte counts are usable sizes, so
+// they include size class and alignment rounding.  An in place realloc()
+// counts as a free of the old size and an allocation of the new one.
+struct erikmt_stats_s {
+    uint64_t bytes_live;        // Handed out to the application
+    uint64_t bytes_mapped;      // Chunks and huge allocations currently mmap()ed
+    uint64_t bytes_retained;    // Empty chunks kept mapped for reuse
+    uint64_t bytes_purged;      // Handed back with madvise(), cumulative
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t class_allocations[SIZE_CLASS_COUNT];
+    uint64_t class_frees[SIZE_CLASS_COUNT];
+    uint64_t large_allocations; // Above MAX_CACHED_SIZE or not a class size
+    uint64_t large_frees;
+    uint64_t mmap_calls;
+    uint64_t munmap_calls;
+    uint64_t lock_contentions;  // Times the heap lock was found held
+};
+
+typedef struct erikmt_stats_s erikmt_stats_s;
+
+void erikmt_get_stats(erikmt_stats_s* stats);
+int erikmt_stat(const char* name, uint64_t* value);
+size_t erikmt_stats_json(char* buf, size_t size);
+
+void stats_record_alloc(size_t size);
+void stats_record_free(size_t size);
+void stats_record_map(size_t size);
+void stats_record_unmap(size_t size);
+void stats_record_remap(size_t old_size, size_t new_size);
+void stats_record_retain(size_t size);
+void stats_record_reuse(size_t size);
+void stats_record_purge(size_t size);
+void stats_record_contention();
+void stats_lock_all();
+void stats_unlock_all();
@@ -1,7 +1,17 @@
 #include <bits/stdc++.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "erikmtalloc.h"
+#include "object_pool.h"
+#include "pmr.h"
+#include "profile.h"
+#include "reserve.h"
+#include "stats.h"
+#include "thread_cache.h"
+#include "trace.h"
 
 using namespace std;
 
@@ -10,6 +20,8 @@ using namespace std;
 #define LARGE_CAPACITY 65535
 // Define parallel threads to test with
 #define THREAD_COUNT 512
+// new/delete pairs performed by each test thread
+#define THREAD_ITERATIONS 16
 
 struct TestStruct {
     char a[1024];
@@ -24,6 +36,14 @@ struct TestStruct {
     }
 };
 
+struct alignas(64) CacheLineStruct {
+    char a[100];
+};
+
+struct alignas(4096) PageStruct {
+    char a[5000];
+};
+
 struct LargeTestStruct {
     char g[LARGE_CAPACITY];
 };
@@ -119,6 +139,835 @@ bool simple_new_test5() {
     return true;
 }
 
+// Freed blocks are cached per CPU (or per thread with ERIKMT_CPU_CACHE=0),
+// so an immediate new of the same size class should get the block back
+// without touching the shared heap.  The thread is pinned to its CPU, or a
+// migration between the delete and the new would switch caches.
+bool thread_cache_reuse_test() {
+    cout << "RUNNING thread_cache_reuse_test" << endl;
+
+    cpu_set_t saved;
+    cpu_set_t pinned;
+    bool is_pinned = false;
+    int cpu = sched_getcpu();
+    if (cpu >= 0 && sched_getaffinity(0, sizeof(saved), &saved) == 0) {
+        CPU_ZERO(&pinned);
+        CPU_SET(cpu, &pinned);
+        is_pinned = sched_setaffinity(0, sizeof(pinned), &pinned) == 0;
+    }
+
+    int *a = new int;
+    delete a;
+    int *b = new int;
+
+    if (is_pinned) {
+        sched_setaffinity(0, sizeof(saved), &saved);
+    }
+
+    EXPECT_PASS(a == b);
+    delete b;
+
+    return true;
+}
+
+// Free enough blocks of one size class to force batches back to the shared heap
+bool thread_cache_flush_test() {
+    cout << "RUNNING thread_cache_flush_test" << endl;
+
+    vector<TestStruct*> structs;
+
+    for (int i=0; i<128; ++i) {
+        structs.push_back(new TestStruct);
+        structs.back()->a[0] = 'X';
+    }
+    for (auto ts : structs) {
+        assert(ts->a[0] == 'X');
+        delete ts;
+    }
+
+    return true;
+}
+
+// Small requests come from size class slabs, rounded up to the class size
+bool slab_size_class_test() {
+    cout << "RUNNING slab_size_class_test" << endl;
+
+    int *a = new int;
+    char *b = new char[100];
+    char *c = new char[1000];
+
+    EXPECT_PASS(get_segment_size(a) == 16);
+    EXPECT_PASS(get_segment_size(b) == 112);
+    EXPECT_PASS(get_segment_size(c) == 1024);
+    EXPECT_PASS(reinterpret_cast<uintptr_t>(a) % 16 == 0);
+
+    delete a;
+    delete[] b;
+    delete[] c;
+
+    return true;
+}
+
+// Allocate more objects than fit in a single slab of the smallest class
+bool slab_many_test() {
+    cout << "RUNNING slab_many_test" << endl;
+
+    vector<int*> ints;
+    ints.reserve(20000);
+
+    for (int i=0; i<20000; ++i) ints.push_back(new int(i));
+    for (int i=0; i<20000; ++i) assert(*ints[i] == i);
+    for (auto a : ints) delete a;
+
+    return true;
+}
+
+// Segment allocations spread over several chunks are resolved through the
+// page map on delete, whatever order they're freed in
+bool pagemap_free_test() {
+    cout << "RUNNING pagemap_free_test" << endl;
+
+    vector<LargeTestStruct*> structs;
+
+    for (int i=0; i<16; ++i) {
+        structs.push_back(new LargeTestStruct);
+        structs.back()->g[0] = 'A' + i;
+    }
+    for (int i=0; i<16; ++i) {
+        EXPECT_PASS(get_segment_size(structs[i]) >= sizeof(LargeTestStruct));
+        assert(structs[i]->g[0] == 'A' + i);
+    }
+    for (int i=0; i<16; i+=2) delete structs[i];
+    for (int i=15; i>0; i-=2) delete structs[i];
+
+    return true;
+}
+
+// Freeing neighbouring segments merges them, so a request the size of both
+// fits where they were, and a smaller request splits the merged segment again
+bool coalesce_test() {
+    cout << "RUNNING coalesce_test" << endl;
+
+    // Best fit may put the first blocks in free segments left behind by
+    // earlier tests, keep allocating until two are carved side by side.  Only
+    // an 8 byte footer and an 8 byte header sit between two segments.
+    vector<char*> fillers;
+    char *a = new char[40000];
+    char *b = new char[40000];
+    for (int i=0; i<16 && b != a + 40000 + 16; ++i) {
+        fillers.push_back(a);
+        a = b;
+        b = new char[40000];
+    }
+    char *c = new char[40000];
+    EXPECT_PASS(b == a + 40000 + 16);
+
+    delete[] a;
+    delete[] b;
+
+    char *d = new char[80000];
+    EXPECT_PASS(d == a);
+    delete[] d;
+
+    char *e = new char[40000];
+    char *f = new char[40000];
+    EXPECT_PASS(e == a);
+    EXPECT_PASS(f == b);
+
+    delete[] e;
+    delete[] f;
+    delete[] c;
+    for (char* filler : fillers) delete[] filler;
+
+    return true;
+}
+
+// Huge requests get their own mapping, which can grow and shrink through
+// resize_segment() without losing its contents
+bool huge_remap_test() {
+    cout << "RUNNING huge_remap_test" << endl;
+
+    size_t size = 1024*1024;
+    char *a = new char[size];
+
+    EXPECT_PASS(get_segment_size(a) >= size);
+    for (size_t i=0; i<size; ++i) a[i] = i % 251;
+
+    char *b = static_cast<char*>(resize_segment(a, size * 64));
+    EXPECT_PASS(b != nullptr);
+    EXPECT_PASS(get_segment_size(b) >= size * 64);
+    for (size_t i=0; i<size; ++i) assert(b[i] == static_cast<char>(i % 251));
+    b[size * 64 - 1] = 'Z';
+
+    char *c = static_cast<char*>(resize_segment(b, size * 2));
+    EXPECT_PASS(c == b);
+    EXPECT_PASS(get_segment_size(c) >= size * 2 && get_segment_size(c) < size * 64);
+    for (size_t i=0; i<size; ++i) assert(c[i] == static_cast<char>(i % 251));
+
+    delete[] c;
+
+    // Segment allocations can't be remapped
+    char *d = new char[40000];
+    EXPECT_PASS(resize_segment(d, 80000) == nullptr);
+    delete[] d;
+
+    return true;
+}
+
+// The C API: zeroed calloc, in place realloc growth and aligned allocations
+bool c_api_test() {
+    cout << "RUNNING c_api_test" << endl;
+
+    char *a = static_cast<char*>(erikmt_calloc(100, 40));
+    for (int i=0; i<4000; ++i) assert(a[i] == 0);
+    EXPECT_PASS(erikmt_malloc_usable_size(a) >= 4000);
+    EXPECT_PASS(reinterpret_cast<uintptr_t>(a) % 16 == 0);
+
+    // a is the newest segment in its chunk, so it can grow into the free space behind it
+    for (int i=0; i<4000; ++i) a[i] = 'C';
+    char *b = static_cast<char*>(erikmt_realloc(a, 8000));
+    EXPECT_PASS(b == a);
+    for (int i=0; i<4000; ++i) assert(b[i] == 'C');
+
+    char *c = static_cast<char*>(erikmt_realloc(b, 1024*1024));
+    for (int i=0; i<4000; ++i) assert(c[i] == 'C');
+    erikmt_free(c);
+
+    void *d = nullptr;
+    EXPECT_PASS(erikmt_posix_memalign(&d, 64, 100) == 0);
+    EXPECT_PASS(reinterpret_cast<uintptr_t>(d) % 64 == 0);
+    erikmt_free(d);
+
+    void *e = erikmt_aligned_alloc(4096, 10000);
+    EXPECT_PASS(reinterpret_cast<uintptr_t>(e) % 4096 == 0);
+    erikmt_free(e);
+
+    EXPECT_PASS(erikmt_posix_memalign(&d, 24, 100) == EINVAL);
+    EXPECT_PASS(erikmt_realloc(nullptr, 16) != nullptr);
+
+    return true;
+}
+
+// Sizes near SIZE_MAX fail cleanly instead of wrapping around to a small
+// mapping
+bool overflow_test() {
+    cout << "RUNNING overflow_test" << endl;
+
+    errno = 0;
+    EXPECT_PASS(erikmt_malloc(SIZE_MAX) == nullptr);
+    EXPECT_PASS(errno == ENOMEM);
+    EXPECT_PASS(erikmt_malloc(SIZE_MAX - 10) == nullptr);
+    EXPECT_PASS(erikmt_aligned_alloc(1024*1024, SIZE_MAX - 100) == nullptr);
+    EXPECT_PASS(erikmt_aligned_alloc(1024*1024, SIZE_MAX - 2*1024*1024) == nullptr);
+
+    char *a = static_cast<char*>(erikmt_malloc(1024*1024));
+    a[0] = 'O';
+    EXPECT_PASS(erikmt_realloc(a, SIZE_MAX - 10) == nullptr);
+    EXPECT_PASS(erikmt_realloc(a, SIZE_MAX) == nullptr);
+    EXPECT_PASS(erikmt_usable_size(a) >= 1024*1024 && a[0] == 'O');
+    erikmt_free(a);
+
+    char *b = static_cast<char*>(erikmt_malloc(100));
+    EXPECT_PASS(erikmt_realloc(b, SIZE_MAX - 10) == nullptr);
+    erikmt_free(b);
+
+    // Volatile, or the compiler rejects the constant size outright
+    volatile size_t too_large = SIZE_MAX - 10;
+    bool threw = false;
+    try {
+        operator delete(operator new(too_large));
+    } catch (const std::bad_alloc&) {
+        threw = true;
+    }
+    EXPECT_PASS(threw);
+
+    return true;
+}
+
+// A segment shrunk to a slab class size and freed isn't cached in that
+// class, whose slots aligned requests rely on being naturally aligned
+bool shrunk_aligned_test() {
+    cout << "RUNNING shrunk_aligned_test" << endl;
+
+    for (int i=0; i<64; ++i) {
+        void* p = erikmt_malloc(4000);
+        EXPECT_PASS(erikmt_shrink(p, 64));
+        erikmt_free(p);
+
+        void* aligned = operator new(64, std::align_val_t(64));
+        EXPECT_PASS(reinterpret_cast<uintptr_t>(aligned) % 64 == 0);
+        operator delete(aligned, std::align_val_t(64));
+    }
+
+    return true;
+}
+
+// Blocks grow into the free space behind them and shrink by handing their
+// tail back, without moving
+bool resize_in_place_test() {
+    cout << "RUNNING resize_in_place_test" << endl;
+
+    // As in coalesce_test, a needs b right behind it
+    vector<char*> fillers;
+    char *a = static_cast<char*>(erikmt_malloc(40000));
+    char *b = static_cast<char*>(erikmt_malloc(40000));
+    for (int i=0; i<16 && b != a + 40000 + 16; ++i) {
+        fillers.push_back(a);
+        a = b;
+        b = static_cast<char*>(erikmt_malloc(40000));
+    }
+    for (int i=0; i<40000; ++i) a[i] = 'R';
+    erikmt_free(b);
+
+    EXPECT_PASS(erikmt_try_expand(a, 70000));
+    EXPECT_PASS(erikmt_usable_size(a) >= 70000);
+    for (int i=0; i<40000; ++i) assert(a[i] == 'R');
+
+    EXPECT_PASS(erikmt_shrink(a, 20000));
+    EXPECT_PASS(erikmt_usable_size(a) >= 20000 && erikmt_usable_size(a) < 40000);
+    for (int i=0; i<20000; ++i) assert(a[i] == 'R');
+
+    // The released tail is handed out again
+    char *c = static_cast<char*>(erikmt_malloc(40000));
+    EXPECT_PASS(c > a && c < a + 70000);
+    EXPECT_PASS(!erikmt_try_expand(a, 70000));
+    erikmt_free(c);
+    erikmt_free(a);
+    for (char* filler : fillers) erikmt_free(filler);
+
+    // Slab slots are fixed size
+    char *small = static_cast<char*>(erikmt_malloc(100));
+    EXPECT_PASS(erikmt_try_expand(small, erikmt_usable_size(small)));
+    EXPECT_PASS(!erikmt_try_expand(small, 2000));
+    EXPECT_PASS(!erikmt_shrink(small, 10));
+    erikmt_free(small);
+
+    char *huge = static_cast<char*>(erikmt_malloc(1024*1024));
+    huge[0] = 'H';
+    EXPECT_PASS(erikmt_shrink(huge, 512*1024));
+    EXPECT_PASS(erikmt_usable_size(huge) >= 512*1024 && erikmt_usable_size(huge) < 1024*1024);
+    if (erikmt_try_expand(huge, 600*1024)) {
+        EXPECT_PASS(erikmt_usable_size(huge) >= 600*1024);
+        huge[600*1024 - 1] = 'H';
+    }
+    // A size that would wrap around the mapping size can't fit
+    EXPECT_PASS(!erikmt_try_expand(huge, SIZE_MAX - 8));
+    EXPECT_PASS(erikmt_usable_size(huge) < 1024*1024);
+    EXPECT_PASS(huge[0] == 'H');
+    erikmt_free(huge);
+
+    EXPECT_PASS(!erikmt_try_expand(nullptr, 10));
+    EXPECT_PASS(erikmt_usable_size(nullptr) == 0);
+
+    return true;
+}
+
+// Batches come out as runs of adjacent slots or segments, and go back with
+// a single call
+bool batch_test() {
+    cout << "RUNNING batch_test" << endl;
+
+    erikmt_stats_s before;
+    erikmt_get_stats(&before);
+
+    void* small[1000];
+    EXPECT_PASS(erikmt_alloc_batch(64, 1000, small) == 1000);
+    size_t adjacent = 0;
+    for (int i=0; i<1000; ++i) {
+        memset(small[i], 'B', 64);
+        if (i && static_cast<char*>(small[i]) == static_cast<char*>(small[i - 1]) + 64) ++adjacent;
+    }
+    EXPECT_PASS(adjacent > 900);
+    EXPECT_PASS(set<void*>(small, small + 1000).size() == 1000);
+
+    void* medium[50];
+    EXPECT_PASS(erikmt_alloc_batch(3000, 50, medium) == 50);
+    adjacent = 0;
+    for (int i=0; i<50; ++i) {
+        memset(medium[i], 'B', 3000);
+        // Segments are 16 bytes of boundary tags apart
+        if (i && static_cast<char*>(medium[i]) == static_cast<char*>(medium[i - 1]) + get_segment_size(medium[i - 1]) + 16) ++adjacent;
+    }
+    EXPECT_PASS(adjacent > 40);
+
+    void* huge[3] = {};
+    EXPECT_PASS(erikmt_alloc_batch(200*1024, 2, huge) == 2);
+
+    erikmt_free_batch(small, 1000);
+    erikmt_free_batch(medium, 50);
+    erikmt_free_batch(huge, 3);
+
+    erikmt_stats_s after;
+    erikmt_get_stats(&after);
+    EXPECT_PASS(after.bytes_live == before.bytes_live);
+
+    return true;
+}
+
+// Over-aligned types get their alignment from operator new(size_t, align_val_t),
+// and sized/aligned deletes hand their blocks back correctly
+bool aligned_new_test() {
+    cout << "RUNNING aligned_new_test" << endl;
+
+    vector<CacheLineStruct*> lines;
+    for (int i=0; i<100; ++i) {
+        lines.push_back(new CacheLineStruct);
+        EXPECT_PASS(reinterpret_cast<uintptr_t>(lines.back()) % 64 == 0);
+        lines.back()->a[99] = 'L';
+    }
+    for (auto l : lines) delete l;
+
+    CacheLineStruct *arr = new CacheLineStruct[30];
+    EXPECT_PASS(reinterpret_cast<uintptr_t>(arr) % 64 == 0);
+    delete[] arr;
+
+    PageStruct *p = new PageStruct;
+    PageStruct *p2 = new PageStruct;
+    EXPECT_PASS(reinterpret_cast<uintptr_t>(p) % 4096 == 0);
+    EXPECT_PASS(reinterpret_cast<uintptr_t>(p2) % 4096 == 0);
+    p->a[4999] = 'P';
+    p2->a[0] = 'P';
+    delete p;
+    delete p2;
+
+    char *big = static_cast<char*>(operator new(3000, std::align_val_t(256)));
+    EXPECT_PASS(reinterpret_cast<uintptr_t>(big) % 256 == 0);
+    EXPECT_PASS(get_segment_size(big) >= 3000);
+    operator delete(big, 3000, std::align_val_t(256));
+
+    int *n = new (std::nothrow) int(5);
+    EXPECT_PASS(n != nullptr && *n == 5);
+    delete n;
+
+    // Sized delete of a block from a size class, then reuse of that block
+    TestStruct *ts = new TestStruct;
+    ::operator delete(ts, sizeof(TestStruct));
+    TestStruct *ts2 = new TestStruct;
+    EXPECT_PASS(ts == ts2);
+    delete ts2;
+
+    return true;
+}
+
+// Blocks allocated on one thread and freed on another go back to the cache
+// of the CPU the freeing thread runs on, and are handed out again from there
+bool cpu_cache_cross_thread_test() {
+    cout << "RUNNING cpu_cache_cross_thread_test" << endl;
+
+    vector<int*> ints;
+    for (int i=0; i<1000; ++i) ints.push_back(new int(i));
+
+    std::thread consumer([&ints]() {
+        for (int i=0; i<1000; ++i) {
+            assert(*ints[i] == i);
+            delete ints[i];
+        }
+        for (int i=0; i<1000; ++i) ints[i] = new int(-i);
+    });
+    consumer.join();
+
+    for (int i=0; i<1000; ++i) {
+        assert(*ints[i] == -i);
+        delete ints[i];
+    }
+
+    return true;
+}
+
+// A free that finds the heap locked by another thread doesn't wait for it:
+// the block is queued on the remote free list and reclaimed by the next
+// allocation from the shared heap
+bool remote_free_test() {
+    cout << "RUNNING remote_free_test" << endl;
+
+    // Too large for the caches, so deletes go straight to the shared heap
+    char* block = new char[40000];
+    void* first = block;
+
+    {
+        unique_lock<mutex> allocation_lock(mut);
+        std::thread consumer([block]() { delete[] block; });
+        consumer.join();
+        // Still allocated, the delete couldn't take the lock
+        EXPECT_PASS(get_segment_size(first) >= 40000);
+    }
+
+    char* reused = new char[40000];
+    EXPECT_PASS(reused == first);
+    delete[] reused;
+
+    return true;
+}
+
+// Free space inside live chunks is purged once, not again on every purge
+// until it's reused
+bool purge_once_test() {
+    cout << "RUNNING purge_once_test" << endl;
+
+    char* a = new char[120000];
+    char* b = new char[120000];
+    char* c = new char[120000];
+    memset(b, 'P', 120000);
+
+    purge_memory();
+    erikmt_stats_s before;
+    erikmt_get_stats(&before);
+
+    delete[] b;
+    purge_memory();
+    erikmt_stats_s first;
+    erikmt_get_stats(&first);
+
+    // Lazily purged pages may stay resident, so check the counter.  Huge
+    // page mode only purges whole huge pages.
+    const char* hugepages = getenv("ERIKMT_HUGEPAGES");
+    if (!hugepages || hugepages[0] != '1') EXPECT_PASS(first.bytes_purged > before.bytes_purged);
+
+    purge_memory();
+    erikmt_stats_s second;
+    erikmt_get_stats(&second);
+    EXPECT_PASS(second.bytes_purged == first.bytes_purged);
+
+    delete[] a;
+    delete[] c;
+
+    return true;
+}
+
+// Chunks that empty out stay mapped in the chunk cache, and purging drops
+// their pages from the RSS without unmapping them
+bool chunk_cache_test() {
+    cout << "RUNNING chunk_cache_test" << endl;
+
+    size_t pagesize = sysconf(_SC_PAGE_SIZE);
+    vector<char*> blocks;
+    for (int i=0; i<8; ++i) {
+        // Too large for the caches and small enough to stay out of the huge path
+        char* block = new char[120000];
+        memset(block, i, 120000);
+        blocks.push_back(block);
+    }
+    for (char* block : blocks) delete[] block;
+
+    purge_memory();
+
+    int purged = 0;
+    for (char* block : blocks) {
+        void* page = reinterpret_cast<void*>((reinterpret_cast<uintptr_t>(block) + 60000) & ~(pagesize - 1));
+        unsigned char resident = 1;
+        // Fails with ENOMEM if the chunk was unmapped instead of cached
+        if (mincore(page, pagesize, &resident) == 0 && !(resident & 1)) ++purged;
+    }
+    // Huge page regions are only purged once all of their chunks are free,
+    // which other live allocations may prevent
+    const char* hugepages = getenv("ERIKMT_HUGEPAGES");
+    if (!hugepages || hugepages[0] != '1') EXPECT_PASS(purged > 0);
+
+    // The cached chunks are handed out again, though best fit may pack the
+    // blocks into them differently, and nothing new is mapped
+    erikmt_stats_s before;
+    erikmt_get_stats(&before);
+    vector<char*> reused;
+    for (int i=0; i<8; ++i) reused.push_back(new char[120000]);
+    erikmt_stats_s after;
+    erikmt_get_stats(&after);
+    EXPECT_PASS(after.mmap_calls == before.mmap_calls);
+    EXPECT_PASS(after.bytes_mapped == before.bytes_mapped);
+    EXPECT_PASS(after.bytes_retained < before.bytes_retained);
+    for (char* block : reused) delete[] block;
+
+    return true;
+}
+
+// A request reuses the free segment closest to its size, rather than the
+// first one large enough
+bool best_fit_test() {
+    cout << "RUNNING best_fit_test" << endl;
+
+    // Too large for the caches, with a live block right behind each one so
+    // they stay separate free segments once freed.  Blocks landing in free
+    // segments left by earlier tests are kept aside until then.
+    size_t sizes[] = {48000, 36000, 42000};
+    char* holes[3];
+    char* fences[3];
+    vector<char*> fillers;
+    for (int i=0; i<3; ++i) {
+        holes[i] = new char[sizes[i]];
+        fences[i] = new char[34000];
+        for (int j=0; j<16 && fences[i] != holes[i] + sizes[i] + 16; ++j) {
+            fillers.push_back(holes[i]);
+            fillers.push_back(fences[i]);
+            holes[i] = new char[sizes[i]];
+            fences[i] = new char[34000];
+        }
+        EXPECT_PASS(fences[i] == holes[i] + sizes[i] + 16);
+    }
+    for (char* hole : holes) delete[] hole;
+
+    char *a = new char[35000];
+    char *b = new char[40000];
+    char *c = new char[47000];
+    EXPECT_PASS(a == holes[1]);
+    EXPECT_PASS(b == holes[2]);
+    EXPECT_PASS(c == holes[0]);
+
+    delete[] a;
+    delete[] b;
+    delete[] c;
+    for (char* fence : fences) delete[] fence;
+    for (char* filler : fillers) delete[] filler;
+
+    return true;
+}
+
+struct HintNode {
+    char data[48];
+};
+
+// Blocks allocated with different lifetime hints never share chunks or
+// slabs, so freeing every short lived block releases their chunks while
+// the long lived ones stay packed together
+bool hint_test() {
+    cout << "RUNNING hint_test" << endl;
+
+    vector<char*> shorts;
+    vector<char*> longs;
+    vector<HintNode*> nodes;
+    for (int i=0; i<256; ++i) {
+        shorts.push_back(new (ERIKMT_HINT_SHORT_LIVED) char[2000]);
+        longs.push_back(new (ERIKMT_HINT_LONG_LIVED) char[2000]);
+        nodes.push_back(new (ERIKMT_HINT_SHORT_LIVED) HintNode);
+        memset(longs.back(), 'L', 2000);
+    }
+    EXPECT_PASS(longs[1] == longs[0] + 2000 + 16);
+    EXPECT_PASS(shorts[1] == shorts[0] + 2000 + 16);
+    EXPECT_PASS(nodes[1] == nodes[0] + 1);
+
+    erikmt_stats_s before;
+    erikmt_get_stats(&before);
+    for (char* block : shorts) delete[] block;
+    for (HintNode* node : nodes) delete node;
+    erikmt_stats_s after;
+    erikmt_get_stats(&after);
+    EXPECT_PASS(after.bytes_mapped - after.bytes_retained < before.bytes_mapped - before.bytes_retained);
+
+    // A hinted block freed through sized delete isn't cached for unhinted
+    // allocations
+    HintNode* hinted = new (ERIKMT_HINT_COLD) HintNode;
+    delete hinted;
+    HintNode* plain = new HintNode;
+    EXPECT_PASS(plain != hinted);
+    delete plain;
+
+    // Moving a block keeps its hint, it's carved right behind the last long
+    // lived block
+    char* moved = static_cast<char*>(erikmt_realloc(longs[0], 4000));
+    EXPECT_PASS(moved == longs.back() + 2000 + 16);
+    EXPECT_PASS(moved[0] == 'L' && moved[1999] == 'L');
+    longs[0] = moved;
+
+    for (char* block : longs) {
+        assert(block[0] == 'L' && block[1999] == 'L');
+        delete[] block;
+    }
+
+    return true;
+}
+
+// Chunks are carved back to back from the reserved range without mmap()
+bool reserve_test() {
+    cout << "RUNNING reserve_test" << endl;
+
+    // An odd size, so no released chunk of the same size is reused
+    size_t size = sysconf(_SC_PAGE_SIZE) * 37;
+    erikmt_stats_s before;
+    erikmt_get_stats(&before);
+
+    char* a = reserve_map(size, sysconf(_SC_PAGE_SIZE));
+    char* b = reserve_map(size, sysconf(_SC_PAGE_SIZE));
+    if (!a) {
+        // Running without a reservation, e.g. under ulimit -v
+        return true;
+    }
+    EXPECT_PASS(b == a + size);
+    memset(a, 1, size * 2);
+
+    erikmt_stats_s during;
+    erikmt_get_stats(&during);
+    EXPECT_PASS(during.mmap_calls == before.mmap_calls);
+    EXPECT_PASS(during.bytes_mapped == before.bytes_mapped + size * 2);
+
+    // Releasing the newest chunks rewinds the bump pointer, and the pages
+    // come back zeroed
+    EXPECT_PASS(reserve_unmap(b, size));
+    EXPECT_PASS(reserve_unmap(a, size));
+    EXPECT_PASS(reserve_map(size, sysconf(_SC_PAGE_SIZE)) == a);
+    EXPECT_PASS(a[0] == 0 && a[size - 1] == 0);
+    EXPECT_PASS(reserve_unmap(a, size));
+
+    char outside[64];
+    EXPECT_FAIL(reserve_unmap(outside, sizeof(outside)));
+
+    return true;
+}
+
+// Released chunks are remembered for reuse even once every free extent
+// slot is taken
+bool reserve_spill_test() {
+    cout << "RUNNING reserve_spill_test" << endl;
+
+    // Another odd size, and every other chunk released so none merge
+    size_t size = sysconf(_SC_PAGE_SIZE) * 41;
+    const int count = RESERVE_FREE_SLOTS * 2 + 8;
+    char* chunks[count];
+    for (int i=0; i<count; ++i) {
+        chunks[i] = reserve_map(size, sysconf(_SC_PAGE_SIZE));
+        if (!chunks[i]) {
+            // Running without a reservation, e.g. under ulimit -v
+            return true;
+        }
+        memset(chunks[i], 1, sysconf(_SC_PAGE_SIZE));
+    }
+    std::set<char*> released;
+    for (int i=0; i<count; i+=2) {
+        EXPECT_PASS(reserve_unmap(chunks[i], size));
+        released.insert(chunks[i]);
+    }
+
+    for (int i=0; i<count; i+=2) {
+        chunks[i] = reserve_map(size, sysconf(_SC_PAGE_SIZE));
+        EXPECT_PASS(released.erase(chunks[i]) == 1);
+        EXPECT_PASS(chunks[i][0] == 0);
+    }
+
+    for (int i=0; i<count; ++i) {
+        EXPECT_PASS(reserve_unmap(chunks[i], size));
+    }
+
+    return true;
+}
+
+// Counters follow allocations and frees, and can be read by name or as JSON
+bool stats_test() {
+    cout << "RUNNING stats_test" << endl;
+
+    vector<char*> small;
+    small.reserve(100);
+
+    erikmt_stats_s before;
+    erikmt_get_stats(&before);
+
+    for (int i=0; i<100; ++i) small.push_back(new char[48]);
+    char* large = new char[40000];
+    char* huge = new char[1024*1024];
+
+    erikmt_stats_s during;
+    erikmt_get_stats(&during);
+    EXPECT_PASS(during.class_allocations[size_class_index(48)] - before.class_allocations[size_class_index(48)] == 100);
+    EXPECT_PASS(during.large_allocations - before.large_allocations == 2);
+    EXPECT_PASS(during.bytes_live - before.bytes_live >= 100*48 + 40000 + 1024*1024);
+    EXPECT_PASS(during.bytes_mapped >= during.bytes_live);
+    EXPECT_PASS(during.mmap_calls > before.mmap_calls);
+
+    for (char* p : small) delete[] p;
+    delete[] large;
+    delete[] huge;
+
+    erikmt_stats_s after;
+    erikmt_get_stats(&after);
+    EXPECT_PASS(after.bytes_live == before.bytes_live);
+    EXPECT_PASS(after.frees - before.frees == 102);
+
+    uint64_t live = 0;
+    EXPECT_PASS(erikmt_stat("bytes.live", &live) == 0);
+    EXPECT_PASS(live == after.bytes_live);
+    EXPECT_PASS(erikmt_stat("no.such.stat", &live) == ENOENT);
+
+    char json[8192];
+    size_t len = erikmt_stats_json(json, sizeof(json));
+    EXPECT_PASS(len < sizeof(json));
+    EXPECT_PASS(strstr(json, "\"bytes.live\":") != nullptr);
+    EXPECT_PASS(json[len - 1] == '}');
+
+    // Truncated output still reports the full length
+    char tiny[16];
+    EXPECT_PASS(erikmt_stats_json(tiny, sizeof(tiny)) == len);
+
+    return true;
+}
+
+static string read_file(const char* path) {
+    ifstream file(path);
+    stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+// With a rate of 1 byte every allocation is sampled, and the samples of one
+// call site are grouped under one stack until they're freed
+bool profile_test() {
+    cout << "RUNNING profile_test" << endl;
+
+    char* blocks[10];
+    erikmt_profile_set_rate(1);
+    for (int i=0; i<10; ++i) blocks[i] = new char[3000];
+    erikmt_profile_set_rate(0);
+
+    const char* path = "/tmp/erikmtalloc_profile_test.heap";
+    EXPECT_PASS(erikmt_profile_dump(path) == 0);
+    string profile = read_file(path);
+    EXPECT_PASS(profile.rfind("heap profile: ", 0) == 0);
+    EXPECT_PASS(profile.find(" @ heap_v2/1\n") != string::npos);
+    EXPECT_PASS(profile.find("\n10: 30000 [10: 30000] @ 0x") != string::npos);
+    EXPECT_PASS(profile.find("MAPPED_LIBRARIES:") != string::npos);
+
+    for (int i=0; i<10; ++i) delete[] blocks[i];
+
+    EXPECT_PASS(erikmt_profile_dump(path) == 0);
+    profile = read_file(path);
+    EXPECT_PASS(profile.find("\n10: 30000 [10: 30000] @ 0x") == string::npos);
+
+    return true;
+}
+
+#ifdef ERIKMT_TRACE
+// Allocations and frees are recorded in the calling thread's ring, and a
+// dump holds them in the trace file format
+bool trace_test() {
+    cout << "RUNNING trace_test" << endl;
+
+    char* block = new char[777];
+    delete[] block;
+
+    const char* path = "/tmp/erikmtalloc_trace_test.bin";
+    EXPECT_PASS(erikmt_trace_dump(path) == 0);
+
+    FILE* file = fopen(path, "rb");
+    EXPECT_PASS(file != nullptr);
+    if (!file) return false;
+
+    trace_file_header_s header;
+    EXPECT_PASS(fread(&header, sizeof(header), 1, file) == 1);
+    EXPECT_PASS(memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0);
+
+    bool allocated = false;
+    bool freed = false;
+    trace_event_s event;
+    while (fread(&event, sizeof(event), 1, file) == 1) {
+        if (event.address != reinterpret_cast<uintptr_t>(block)) continue;
+        if (event.type == TRACE_ALLOC && event.size == 777) allocated = true;
+        if (event.type == TRACE_FREE && allocated) freed = true;
+    }
+    fclose(file);
+    unlink(path);
+
+    EXPECT_PASS(allocated);
+    EXPECT_PASS(freed);
+
+    return true;
+}
+#endif
+
 // Goals
 // - Test base case (no modifications to allocator) for time per allocation
 // - Test with modified allocator and measure delta
@@ -129,19 +978,59 @@ void* thread_test1(void *threadid) {
 
     cout << "Starting thread: " << tid << endl;
 
-    TestStruct *ts = new TestStruct;
+    for (int n=0; n<THREAD_ITERATIONS; ++n) {
+        TestStruct *ts = new TestStruct;
+        int *a = new int;
 
-    for (int i=0; i<sizeof(ts->a)/sizeof(char); ++i) ts->a[i] = 'X';
-    for (int i=0; i<sizeof(ts->b)/sizeof(char); ++i) ts->b[i] = 'X';
-    for (int i=0; i<sizeof(ts->c)/sizeof(char); ++i) ts->c[i] = 'X';
-    for (int i=0; i<sizeof(ts->d)/sizeof(char); ++i) ts->d[i] = 'X';
-    for (int i=0; i<sizeof(ts->e)/sizeof(int); ++i) ts->e[i] = 7;
-    for (int i=0; i<sizeof(ts->f)/sizeof(double); ++i) ts->f[i] = 3.14;
+        for (int i=0; i<sizeof(ts->a)/sizeof(char); ++i) ts->a[i] = 'X';
+        for (int i=0; i<sizeof(ts->b)/sizeof(char); ++i) ts->b[i] = 'X';
+        for (int i=0; i<sizeof(ts->c)/sizeof(char); ++i) ts->c[i] = 'X';
+        for (int i=0; i<sizeof(ts->d)/sizeof(char); ++i) ts->d[i] = 'X';
+        for (int i=0; i<sizeof(ts->e)/sizeof(int); ++i) ts->e[i] = 7;
+        for (int i=0; i<sizeof(ts->f)/sizeof(double); ++i) ts->f[i] = 3.14;
+        *a = n;
 
-    delete ts;
+        delete a;
+        delete ts;
+    }
     pthread_exit(NULL);
 }
 
+#define PRODUCER_CONSUMER_BLOCKS 20000
+
+// One thread allocates messages of mixed sizes, another frees them, so every
+// delete is a cross-thread free
+void producer_consumer_runner() {
+    vector<atomic<char*>> queue(PRODUCER_CONSUMER_BLOCKS);
+    static const size_t sizes[] = { 24, 200, 1000, 3000, 40000 };
+
+    auto start = std::chrono::system_clock::now();
+
+    std::thread producer([&queue]() {
+        for (int i=0; i<PRODUCER_CONSUMER_BLOCKS; ++i) {
+            char* msg = new char[sizes[i % 5]];
+            msg[0] = static_cast<char>(i);
+            queue[i].store(msg, memory_order_release);
+        }
+    });
+
+    std::thread consumer([&queue]() {
+        for (int i=0; i<PRODUCER_CONSUMER_BLOCKS; ++i) {
+            char* msg;
+            while (!(msg = queue[i].load(memory_order_acquire))) this_thread::yield();
+            assert(msg[0] == static_cast<char>(i));
+            delete[] msg;
+        }
+    });
+
+    producer.join();
+    consumer.join();
+
+    auto end = std::chrono::system_clock::now();
+    chrono::duration<double> elapsed_time = end - start;
+    cout << "PRODUCER/CONSUMER ELAPSED TIME: " << elapsed_time.count() << " seconds" << endl;
+}
+
 void thread_runner() {
     pthread_t threads[THREAD_COUNT];
 
@@ -160,6 +1049,143 @@ void thread_runner() {
     cout << "ELAPSED TIME: " << elapsed_time.count() << " seconds" << endl;
 }
 
+// The pmr resources allocate, reuse and hand back memory through the heap
+bool pmr_test() {
+    cout << "RUNNING pmr_test" << endl;
+
+    erikmt_pool_resource* pool = erikmt_pool();
+    {
+        std::pmr::vector<int> v(pool);
+        for (int i = 0; i < 10000; ++i) {
+            v.push_back(i);
+        }
+        EXPECT_PASS(v[9999] == 9999);
+        EXPECT_PASS(erikmt_usable_size(v.data()) >= 10000 * sizeof(int));
+    }
+
+    void* aligned = pool->allocate(100, 256);
+    EXPECT_PASS(reinterpret_cast<uintptr_t>(aligned) % 256 == 0);
+    pool->deallocate(aligned, 100, 256);
+    EXPECT_PASS(pool->is_equal(*erikmt_pool()));
+
+    erikmt_stats_s before;
+    erikmt_get_stats(&before);
+    {
+        // Freed blocks are reused from the private free lists first
+        erikmt_local_pool_resource local;
+        void* a = local.allocate(48);
+        local.deallocate(a, 48);
+        EXPECT_PASS(local.allocate(48) == a);
+        local.deallocate(a, 48);
+
+        std::pmr::list<std::pmr::string> strings(&local);
+        for (int i = 0; i < 1000; ++i) {
+            strings.emplace_back(100, 'x');
+        }
+        EXPECT_PASS(strings.back().size() == 100);
+        EXPECT_FAIL(local.is_equal(*pool));
+    }
+    erikmt_stats_s after;
+    erikmt_get_stats(&after);
+    EXPECT_PASS(after.bytes_live == before.bytes_live);
+
+    erikmt_arena arena;
+    {
+        erikmt_arena_scope scope(arena);
+        std::pmr::vector<std::pmr::string> strings(&arena);
+        for (int i = 0; i < 10000; ++i) {
+            strings.emplace_back(64, 'y');
+        }
+        EXPECT_PASS(strings[9999][63] == 'y');
+        EXPECT_PASS(arena.bytes_used() > 10000 * 64);
+
+        void* p = arena.allocate(10, 4096);
+        EXPECT_PASS(reinterpret_cast<uintptr_t>(p) % 4096 == 0);
+    }
+    EXPECT_PASS(arena.bytes_used() == 0);
+
+    // Requests after the scope continue from where it began, an inner scope
+    // only drops what was allocated inside of it
+    char* first = static_cast<char*>(arena.allocate(16));
+    {
+        erikmt_arena_scope scope(arena);
+        EXPECT_PASS(arena.allocate(1024 * 1024));
+    }
+    char* second = static_cast<char*>(arena.allocate(16));
+    EXPECT_PASS(second == first + 16);
+
+    arena.reset();
+    EXPECT_PASS(arena.allocate(16) == first);
+    arena.release();
+    EXPECT_PASS(arena.bytes_used() == 0);
+
+    // Larger than any block the arena would map by itself
+    void* big = arena.allocate(ARENA_MAX_BLOCK_SIZE * 2);
+    memset(big, 1, ARENA_MAX_BLOCK_SIZE * 2);
+
+    return true;
+}
+
+struct alignas(64) PoolNode {
+    PoolNode* left;
+    PoolNode* right;
+    int value;
+
+    explicit PoolNode(int v) : left(nullptr), right(nullptr), value(v) {}
+};
+
+static_assert(erikmt_object_pool<PoolNode>::slot_size == 64, "node slots are a cache line");
+static_assert(erikmt_object_pool<char>::slot_size == sizeof(void*), "slots hold the free list link");
+static_assert(erikmt_object_pool<char[100000]>::slots_per_chunk >= OBJECT_POOL_MIN_SLOTS, "large objects get larger chunks");
+
+// Typed pools reuse freed slots first, and their allocator serves node based
+// containers from the calling thread's pool
+bool object_pool_test() {
+    cout << "RUNNING object_pool_test" << endl;
+
+    {
+        erikmt_object_pool<PoolNode> pool;
+        vector<PoolNode*> nodes;
+        for (int i = 0; i < 1000; ++i) {
+            PoolNode* node = pool.create(i);
+            EXPECT_PASS(reinterpret_cast<uintptr_t>(node) % 64 == 0);
+            nodes.push_back(node);
+        }
+        EXPECT_PASS(nodes[999]->value == 999);
+        // Slots of a chunk are handed out back to back
+        EXPECT_PASS(reinterpret_cast<char*>(nodes[1]) == reinterpret_cast<char*>(nodes[0]) + 64);
+
+        PoolNode* freed = nodes[500];
+        pool.destroy(freed);
+        EXPECT_PASS(pool.create(7) == freed);
+
+        for (PoolNode* node : nodes) pool.destroy(node);
+    }
+
+    std::map<int, std::string, std::less<int>, erikmt_object_allocator<std::pair<const int, std::string>>> map;
+    for (int i = 0; i < 1000; ++i) {
+        map[i] = std::to_string(i);
+    }
+    EXPECT_PASS(map[123] == "123");
+
+    // Nodes allocated by an exited thread stay valid and can be freed here
+    std::list<int, erikmt_object_allocator<int>> list;
+    std::thread filler([&list]() {
+        for (int i = 0; i < 1000; ++i) {
+            list.push_back(i);
+        }
+    });
+    filler.join();
+    EXPECT_PASS(list.size() == 1000 && list.back() == 999);
+    list.clear();
+    map.clear();
+
+    std::vector<int, erikmt_object_allocator<int>> array(1000, 1);
+    EXPECT_PASS(array[999] == 1);
+
+    return true;
+}
+
 void run_simple_new_tests() {
     EXPECT_PASS(simple_new_test());
 
@@ -189,9 +1215,40 @@ void run_simple_new_tests() {
     EXPECT_PASS(simple_new_test5());
     EXPECT_PASS(simple_new_test5());
     EXPECT_PASS(simple_new_test5());
+
+    EXPECT_PASS(thread_cache_reuse_test());
+    EXPECT_PASS(thread_cache_flush_test());
+
+    EXPECT_PASS(slab_size_class_test());
+    EXPECT_PASS(slab_many_test());
+    EXPECT_PASS(pagemap_free_test());
+    EXPECT_PASS(coalesce_test());
+    EXPECT_PASS(huge_remap_test());
+    EXPECT_PASS(c_api_test());
+    EXPECT_PASS(overflow_test());
+    EXPECT_PASS(resize_in_place_test());
+    EXPECT_PASS(shrunk_aligned_test());
+    EXPECT_PASS(batch_test());
+    EXPECT_PASS(aligned_new_test());
+    EXPECT_PASS(cpu_cache_cross_thread_test());
+    EXPECT_PASS(remote_free_test());
+    EXPECT_PASS(chunk_cache_test());
+    EXPECT_PASS(purge_once_test());
+    EXPECT_PASS(reserve_test());
+    EXPECT_PASS(reserve_spill_test());
+    EXPECT_PASS(best_fit_test());
+    EXPECT_PASS(hint_test());
+    EXPECT_PASS(stats_test());
+    EXPECT_PASS(profile_test());
+    EXPECT_PASS(pmr_test());
+    EXPECT_PASS(object_pool_test());
+#ifdef ERIKMT_TRACE
+    EXPECT_PASS(trace_test());
+#endif
     
     // Thread tests
     thread_runner();
+    producer_consumer_runner();
 }
 
 // Timed loop of new / delete
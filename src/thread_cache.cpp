@@ -0,0 +1,514 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <pthread.h>
+
+#include "chunk_cache.h"
+#include "cpu_cache.h"
+#include "erikmtalloc.h"
+#include "huge.h"
+#include "pagemap.h"
+#include "profile.h"
+#include "slab.h"
+#include "stats.h"
+#include "size_classes.h"
+#include "thread_cache.h"
+#include "trace.h"
+#include "utils.h"
+
+using namespace std;
+
+mutex mut;
+
+// Set by the first hinted allocation.  Until then sized frees can cache
+// blocks without looking up their chunk's hint.
+static atomic<bool> hints_used{false};
+
+// Take mut, counting the acquisitions that had to wait for another thread
+unique_lock<mutex> lock_heap() {
+    unique_lock<mutex> allocation_lock(mut, try_to_lock);
+    if (!allocation_lock.owns_lock()) {
+        stats_record_contention();
+        allocation_lock.lock();
+    }
+    return allocation_lock;
+}
+
+// Take mut for a get_segment()/get_segments() call of size bytes.  Slab
+// sizes are served under their own size class lock instead, so they don't
+// take mut at all and get an empty lock.
+unique_lock<mutex> lock_heap_for(size_t size) {
+    if (size <= SLAB_MAX_SIZE) {
+        return unique_lock<mutex>();
+    }
+    return lock_heap();
+}
+
+// Singly linked list of cached blocks for one size class.  The link pointer
+// is stored in the first bytes of the (free) block itself.
+struct tcache_bin_s {
+    void* head;
+    unsigned int count;
+};
+
+// Per-thread cache of recently freed blocks.  Kept trivially constructible
+// and destructible so that accessing it never allocates; thread exit is
+// handled through a pthread key destructor instead.
+struct thread_cache_s {
+    tcache_bin_s bins[SIZE_CLASS_COUNT];
+    bool initialized;
+    bool torn_down;
+};
+
+typedef struct tcache_bin_s tcache_bin_s;
+typedef struct thread_cache_s thread_cache_s;
+
+static thread_local thread_cache_s tcache __attribute__((tls_model("initial-exec")));
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static void bin_push(tcache_bin_s* bin, void* ptr) {
+    *static_cast<void**>(ptr) = bin->head;
+    bin->head = ptr;
+    bin->count += 1;
+}
+
+static void* bin_pop(tcache_bin_s* bin) {
+    void* ptr = bin->head;
+    bin->head = *static_cast<void**>(ptr);
+    bin->count -= 1;
+    return ptr;
+}
+
+// Return up to count blocks from a bin to the shared heap.  They're already
+// linked through their first word, so the chain is handed over as is.
+static void flush_bin(tcache_bin_s* bin, unsigned int count) {
+    if (!bin->head || count == 0) {
+        return;
+    }
+
+    void* first = bin->head;
+    void* last = first;
+    unsigned int n = 1;
+
+    while (n < count && *static_cast<void**>(last)) {
+        last = *static_cast<void**>(last);
+        ++n;
+    }
+
+    bin->head = *static_cast<void**>(last);
+    bin->count -= n;
+    *static_cast<void**>(last) = nullptr;
+
+    heap_free_chain(first, last);
+}
+
+static thread_cache_s* get_tcache();
+
+// Return a chain of blocks, linked through their first word and ending at
+// last, to the shared heap.  Slab slots go straight back under their size
+// class lock, held across runs of the same class.  Segments never wait for
+// mut: if another thread holds it, they go onto the heap's remote free list
+// with a single CAS, and whoever takes mut next frees them.
+void heap_free_chain(void* first, void* last) {
+    void* segments = nullptr;
+    void* segments_last = nullptr;
+    unique_lock<mutex> class_lock;
+
+    void* ptr = first;
+    while (ptr) {
+        // Read the link first, freeing may unmap the block
+        void* next = *static_cast<void**>(ptr);
+        chunk_s* chunk = pagemap_lookup(ptr);
+
+        if (chunk && chunk->is_slab) {
+            if (class_lock.mutex() != &slab_lock(chunk)) {
+                // Never hold two class locks at once
+                if (class_lock.owns_lock()) {
+                    class_lock.unlock();
+                }
+                class_lock = unique_lock<mutex>(slab_lock(chunk));
+            }
+            slab_free(chunk, ptr);
+        } else {
+            *static_cast<void**>(ptr) = segments;
+            segments = ptr;
+            if (!segments_last) {
+                segments_last = ptr;
+            }
+        }
+        ptr = next;
+    }
+    if (class_lock.owns_lock()) {
+        class_lock.unlock();
+    }
+
+    if (!segments) {
+        // Empty slabs may have evicted chunks from the chunk cache, they're
+        // only unmapped now that no lock is held
+        chunk_cache_release_evicted();
+        return;
+    }
+
+    if (!mut.try_lock()) {
+        debug(std::cout, "Deferring free of", segments, "to the remote free list");
+        stats_record_contention();
+        push_remote_frees(segments, segments_last);
+        chunk_cache_release_evicted();
+        return;
+    }
+
+    // Once per chain rather than per block, it reads the clock
+    decay_tick();
+    drain_remote_frees();
+
+    ptr = segments;
+    while (ptr) {
+        // Read the link first, freeing may coalesce or unmap the block
+        void* next = *static_cast<void**>(ptr);
+        free_segment(ptr);
+        ptr = next;
+    }
+
+    mut.unlock();
+    chunk_cache_release_evicted();
+}
+
+void heap_free(void* ptr) {
+    *static_cast<void**>(ptr) = nullptr;
+    heap_free_chain(ptr, ptr);
+}
+
+void heap_free_batch(void** blocks, unsigned int count) {
+    for (unsigned int i = 0; i + 1 < count; ++i) {
+        *static_cast<void**>(blocks[i]) = blocks[i + 1];
+    }
+    *static_cast<void**>(blocks[count - 1]) = nullptr;
+
+    heap_free_chain(blocks[0], blocks[count - 1]);
+}
+
+// Cache a freed block in its size class bin, on the current CPU or in the
+// calling thread's cache, flushing a batch back to the shared heap once the
+// thread's bin holds more than two batches
+static void cache_block(size_t index, void* ptr) {
+    if (cpu_cache_enabled()) {
+        cpu_cache_free(index, ptr);
+        return;
+    }
+
+    thread_cache_s* tc = get_tcache();
+    if (!tc) {
+        heap_free(ptr);
+        return;
+    }
+
+    tcache_bin_s* bin = &tc->bins[index];
+    bin_push(bin, ptr);
+
+    unsigned int count = size_class_batch(index);
+    if (bin->count > count * 2) {
+        debug(std::cout, "Flushing", count, "blocks from thread cache class", size_class_size(index));
+        flush_bin(bin, count);
+    }
+}
+
+// Called by pthreads on thread exit, hands every cached block back
+static void tcache_destructor(void*) {
+    tcache_flush();
+    tcache.torn_down = true;
+}
+
+static void create_tcache_key() {
+    pthread_key_create(&tcache_key, tcache_destructor);
+}
+
+// Returns the calling thread's cache, or nullptr if the thread is exiting
+static thread_cache_s* get_tcache() {
+    if (tcache.torn_down) {
+        return nullptr;
+    }
+
+    if (!tcache.initialized) {
+        // Set first, pthreads may allocate while registering the key
+        tcache.initialized = true;
+        pthread_once(&tcache_key_once, create_tcache_key);
+        // Any non-null value makes pthreads call the destructor on exit
+        pthread_setspecific(tcache_key, &tcache);
+    }
+
+    return &tcache;
+}
+
+// Usable size of a cached block.  Slab slots are exactly the class size, but
+// a reused segment can be a little larger than the class it was handed out
+// for, and stats count blocks by their usable size.
+static size_t cached_block_size(void* ptr, size_t class_size) {
+    return (class_size > SLAB_MAX_SIZE) ? get_segment_size(ptr) : class_size;
+}
+
+// Count an allocation of the block's usable size
+static void* record_alloc(void* ptr) {
+    if (ptr) {
+        stats_record_alloc(get_segment_size(ptr));
+    }
+    return ptr;
+}
+
+// Allocate directly from the shared heap
+static void* locked_alloc(size_t size) {
+    debug(std::cout, "Acquiring lock in tcache_alloc");
+    unique_lock<mutex> allocation_lock = lock_heap_for(size);
+
+    return get_segment(size);
+}
+
+// Serve an allocation from the current CPU's cache or the calling thread's
+// cache, refilling the size class with a batch of blocks from find_segment()
+// when it's empty.
+// Blocks up to MAX_CACHED_SIZE are always rounded to their class size, even
+// when bypassing the cache, so that any of them can be cached on free.
+static void* cache_alloc(size_t size) {
+    // Huge allocations are mapped directly, without taking the global lock
+    if (size >= huge_threshold) {
+        return record_alloc(huge_alloc(size));
+    }
+
+    if (size > MAX_CACHED_SIZE) {
+        return record_alloc(locked_alloc(size));
+    }
+
+    size_t index = size_class_index(size);
+    size_t class_size = size_class_size(index);
+
+    if (cpu_cache_enabled()) {
+        void* ptr = cpu_cache_alloc(index);
+        if (ptr) {
+            stats_record_alloc(cached_block_size(ptr, class_size));
+        }
+        return ptr;
+    }
+
+    thread_cache_s* tc = get_tcache();
+
+    if (!tc) {
+        return record_alloc(locked_alloc(class_size));
+    }
+
+    tcache_bin_s* bin = &tc->bins[index];
+
+    if (bin->head == nullptr) {
+        unsigned int count = size_class_batch(index);
+        debug(std::cout, "Refilling thread cache class", class_size, "with", count, "blocks");
+
+        void* batch[CACHE_MAX_BATCH];
+        unique_lock<mutex> allocation_lock = lock_heap_for(class_size);
+        count = get_segments(class_size, count, batch);
+        if (allocation_lock.owns_lock()) {
+            allocation_lock.unlock();
+        }
+
+        // The last block carved is handed out first, like the CPU caches
+        for (unsigned int i = 0; i < count; ++i) {
+            bin_push(bin, batch[i]);
+        }
+
+        if (bin->head == nullptr) {
+            return nullptr;
+        }
+    }
+
+    void* ptr = bin_pop(bin);
+    stats_record_alloc(cached_block_size(ptr, class_size));
+    return ptr;
+}
+
+void* tcache_alloc(size_t size) {
+    void* ptr = cache_alloc(size);
+    trace(TRACE_ALLOC, ptr, size);
+    profile_record_alloc(ptr, size);
+    return ptr;
+}
+
+// Cache a freed block in its size class, or hand it back to the shared heap
+// if it doesn't match a class size or came from hinted chunks, which the
+// caches would hand out again for unhinted requests.  Slab class bins only
+// take slab slots: a segment shrunk down to a slab class size lacks the
+// natural alignment the aligned slab classes promise.
+void tcache_free(void* ptr) {
+    chunk_s* chunk = pagemap_lookup(ptr);
+    if (!chunk) {
+        debug(std::cout, "Ignoring free of unknown ptr", ptr);
+        return;
+    }
+    profile_record_free(ptr);
+    if (chunk->is_huge) {
+        trace(TRACE_FREE, ptr, huge_usable_size(chunk));
+        stats_record_free(huge_usable_size(chunk));
+        huge_free(chunk);
+        return;
+    }
+
+    size_t size = get_segment_size(ptr);
+    size_t index = size_class_index(size);
+    trace(TRACE_FREE, ptr, size);
+    stats_record_free(size);
+
+    if (size > MAX_CACHED_SIZE || size_class_size(index) != size || chunk->hint != ERIKMT_HINT_NONE ||
+        (size <= SLAB_MAX_SIZE && !chunk->is_slab)) {
+        heap_free(ptr);
+        return;
+    }
+
+    cache_block(index, ptr);
+}
+
+static bool is_hinted(void* ptr) {
+    return hints_used.load(memory_order_relaxed) && pagemap_lookup(ptr)->hint != ERIKMT_HINT_NONE;
+}
+
+// Free a block whose requested size the caller knows (sized delete).  Any
+// request up to MAX_CACHED_SIZE was served as a block of at least its class
+// size, so the block goes straight into that bin without looking up the
+// chunk or segment header.
+void tcache_free_sized(void* ptr, size_t size) {
+    if (size > MAX_CACHED_SIZE || size >= huge_threshold || is_hinted(ptr)) {
+        tcache_free(ptr);
+        return;
+    }
+
+    size_t index = size_class_index(size);
+    trace(TRACE_FREE, ptr, size);
+    stats_record_free(cached_block_size(ptr, size_class_size(index)));
+    profile_record_free(ptr);
+    cache_block(index, ptr);
+}
+
+// Allocate up to count blocks of size bytes under a single acquisition of
+// mut, bypassing the caches.  Sizes up to MAX_CACHED_SIZE are rounded to
+// their class size like any other allocation, so the blocks can be freed one
+// by one as well.  Returns how many were allocated.
+size_t tcache_alloc_batch(size_t size, size_t count, void** out) {
+    size_t block_size = (size <= MAX_CACHED_SIZE) ? size_class_size(size_class_index(size)) : size;
+    size_t n = 0;
+
+    if (size >= huge_threshold) {
+        while (n < count && (out[n] = huge_alloc(size))) {
+            ++n;
+        }
+    } else {
+        unique_lock<mutex> allocation_lock = lock_heap_for(block_size);
+        n = get_segments(block_size, count, out);
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        stats_record_alloc(cached_block_size(out[i], block_size));
+        trace(TRACE_ALLOC, out[i], size);
+        profile_record_alloc(out[i], size);
+    }
+    return n;
+}
+
+// Free count blocks (null pointers are skipped) with a single acquisition of
+// mut, or a single push onto the remote free list if another thread holds it
+void tcache_free_batch(void** blocks, size_t count) {
+    void* first = nullptr;
+    void* last = nullptr;
+
+    for (size_t i = 0; i < count; ++i) {
+        void* ptr = blocks[i];
+        chunk_s* chunk = ptr ? pagemap_lookup(ptr) : nullptr;
+        if (!chunk) {
+            continue;
+        }
+
+        profile_record_free(ptr);
+        if (chunk->is_huge) {
+            trace(TRACE_FREE, ptr, huge_usable_size(chunk));
+            stats_record_free(huge_usable_size(chunk));
+            huge_free(chunk);
+            continue;
+        }
+
+        size_t size = chunk->is_slab ? slab_block_size(chunk) : get_segment_size(ptr);
+        trace(TRACE_FREE, ptr, size);
+        stats_record_free(size);
+
+        // Link the blocks in the order given
+        *static_cast<void**>(ptr) = nullptr;
+        if (last) {
+            *static_cast<void**>(last) = ptr;
+        } else {
+            first = ptr;
+        }
+        last = ptr;
+    }
+
+    if (first) {
+        heap_free_chain(first, last);
+    }
+}
+
+// Allocate a block aligned to alignment bytes (a power of two).  Requests
+// that only need the default alignment, or that can use a slab class with
+// naturally aligned slots, still go through the cache.
+static void* cache_alloc_aligned(size_t size, size_t alignment) {
+    if (alignment <= MIN_ALIGNMENT) {
+        return cache_alloc(size);
+    }
+
+    if (alignment <= SLAB_SLOT_ALIGNMENT && size <= SLAB_MAX_SIZE) {
+        return cache_alloc(aligned_class_size(size, alignment));
+    }
+
+    if (size >= huge_threshold) {
+        return record_alloc(huge_alloc(size, alignment));
+    }
+
+    debug(std::cout, "Acquiring lock in tcache_alloc_aligned");
+    unique_lock<mutex> allocation_lock = lock_heap();
+    void* ptr = get_aligned_segment(size, alignment);
+    allocation_lock.unlock();
+
+    return record_alloc(ptr);
+}
+
+void* tcache_alloc_aligned(size_t size, size_t alignment) {
+    void* ptr = cache_alloc_aligned(size, alignment);
+    trace(TRACE_ALLOC, ptr, size);
+    profile_record_alloc(ptr, size);
+    return ptr;
+}
+
+// Allocate from the slabs and chunks kept for hint, under their lock and
+// without going through the caches
+static void* hinted_alloc(size_t size, erikmt_hint hint) {
+    if (hint == ERIKMT_HINT_NONE) {
+        return cache_alloc(size);
+    }
+    if (size >= huge_threshold) {
+        return record_alloc(huge_alloc(size));
+    }
+
+    if (!hints_used.load(memory_order_relaxed)) {
+        hints_used.store(true, memory_order_relaxed);
+    }
+
+    unique_lock<mutex> allocation_lock = lock_heap_for(size);
+    return record_alloc(get_hinted_segment(size, hint));
+}
+
+void* tcache_alloc_hint(size_t size, erikmt_hint hint) {
+    void* ptr = hinted_alloc(size, hint);
+    trace(TRACE_ALLOC, ptr, size);
+    profile_record_alloc(ptr, size);
+    return ptr;
+}
+
+// Release every block cached by the calling thread to the shared heap
+void tcache_flush() {
+    for (size_t i = 0; i < SIZE_CLASS_COUNT; ++i) {
+        flush_bin(&tcache.bins[i], tcache.bins[i].count);
+    }
+}
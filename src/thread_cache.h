@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+
+#include "erikmtalloc.h"
+
+// Global allocator lock, guarding the shared chunk/segment lists
+extern std::mutex mut;
+
+void* tcache_alloc(size_t size);
+void tcache_free(void* ptr);
+void tcache_free_sized(void* ptr, size_t size);
+void* tcache_alloc_aligned(size_t size, size_t alignment);
+void* tcache_alloc_hint(size_t size, erikmt_hint hint);
+size_t tcache_alloc_batch(size_t size, size_t count, void** out);
+void tcache_free_batch(void** blocks, size_t count);
+void tcache_flush();
+std::unique_lock<std::mutex> lock_heap();
+std::unique_lock<std::mutex> lock_heap_for(size_t size);
+void heap_free(void* ptr);
+void heap_free_batch(void** blocks, unsigned int count);
+void heap_free_chain(void* first, void* last);
@@ -0,0 +1,176 @@
+#include "trace.h"
+
+#ifdef ERIKMT_TRACE
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// Every thread records its events into a ring buffer of its own, so tracing
+// takes no lock and never allocates: the owner writes an event, then
+// publishes it by bumping head.  Rings are mmap()ed, never freed, and handed
+// to a new thread once their owner exits, so the events of exited threads
+// stay around to be dumped until then.  A dump taken while threads are still
+// running may catch an event in the middle of being overwritten.
+struct trace_ring_s {
+    trace_ring_s* next;         // Every ring ever created
+    std::atomic<uint64_t> head; // Events written so far
+    std::atomic<bool> in_use;
+    uint32_t thread;
+    trace_event_s events[TRACE_RING_EVENTS];
+};
+
+typedef struct trace_ring_s trace_ring_s;
+
+static std::atomic<trace_ring_s*> rings;
+
+static thread_local trace_ring_s* ring __attribute__((tls_model("initial-exec")));
+static thread_local bool torn_down __attribute__((tls_model("initial-exec")));
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Reuse the ring of an exited thread, or map a new one
+static trace_ring_s* acquire_ring() {
+    for (trace_ring_s* r = rings.load(std::memory_order_acquire); r; r = r->next) {
+        bool expected = false;
+        if (r->in_use.compare_exchange_strong(expected, true)) {
+            return r;
+        }
+    }
+
+    void* ptr = mmap(NULL, sizeof(trace_ring_s), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return nullptr;
+    }
+
+    // Zeroed memory is an empty ring
+    trace_ring_s* r = static_cast<trace_ring_s*>(ptr);
+    r->in_use.store(true, std::memory_order_relaxed);
+
+    trace_ring_s* head = rings.load(std::memory_order_relaxed);
+    do {
+        r->next = head;
+    } while (!rings.compare_exchange_weak(head, r, std::memory_order_release, std::memory_order_relaxed));
+
+    return r;
+}
+
+// Called by pthreads on thread exit, hands the ring to the next new thread
+static void trace_destructor(void*) {
+    ring->in_use.store(false, std::memory_order_release);
+    ring = nullptr;
+    torn_down = true;
+}
+
+static void create_trace_key() {
+    pthread_key_create(&trace_key, trace_destructor);
+}
+
+static trace_ring_s* get_ring() {
+    if (ring || torn_down) {
+        return ring;
+    }
+
+    ring = acquire_ring();
+    if (!ring) {
+        return nullptr;
+    }
+    ring->thread = gettid();
+
+    // Set up after ring, pthreads may allocate while registering the key
+    pthread_once(&trace_key_once, create_trace_key);
+    pthread_setspecific(trace_key, ring);
+
+    return ring;
+}
+
+void trace_event(trace_event_type type, const void* address, size_t size) {
+    trace_ring_s* r = get_ring();
+    if (!r) {
+        return;
+    }
+
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+    trace_event_s* event = &r->events[head % TRACE_RING_EVENTS];
+
+    event->timestamp = now_ns();
+    event->address = reinterpret_cast<uintptr_t>(address);
+    event->size = size;
+    event->thread = r->thread;
+    event->type = type;
+
+    r->head.store(head + 1, std::memory_order_release);
+}
+
+static bool write_all(int fd, const void* buf, size_t size) {
+    const char* p = static_cast<const char*>(buf);
+    while (size) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Write every thread's retained events to path, in the format read by
+// tracedump.  Doesn't allocate, so it's safe to call from anywhere.  Returns
+// 0, or -1 with errno set.
+int erikmt_trace_dump(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    trace_file_header_s header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.event_size = sizeof(trace_event_s);
+    bool ok = write_all(fd, &header, sizeof(header));
+
+    for (trace_ring_s* r = rings.load(std::memory_order_acquire); r && ok; r = r->next) {
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        uint64_t count = (head < TRACE_RING_EVENTS) ? head : TRACE_RING_EVENTS;
+        uint64_t first = (head - count) % TRACE_RING_EVENTS;
+
+        // The oldest events sit from first to the end of the buffer
+        uint64_t tail = (first + count > TRACE_RING_EVENTS) ? TRACE_RING_EVENTS - first : count;
+        ok = write_all(fd, &r->events[first], tail * sizeof(trace_event_s)) &&
+            write_all(fd, &r->events[0], (count - tail) * sizeof(trace_event_s));
+    }
+
+    int saved_errno = errno;
+    close(fd);
+    if (!ok) {
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+// Set ERIKMT_TRACE_FILE to dump the trace when the process exits
+__attribute__((destructor)) static void dump_at_exit() {
+    const char* path = getenv("ERIKMT_TRACE_FILE");
+    if (path) {
+        erikmt_trace_dump(path);
+    }
+}
+
+#endif
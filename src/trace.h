@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Binary event tracing, compiled in with `make TRACE=1` (ERIKMT_TRACE).
+// Otherwise trace() compiles to nothing.
+#define TRACE_RING_EVENTS 8192 // Events kept per thread, the oldest are overwritten
+#define TRACE_MAGIC "ERIKMTTR"
+#define TRACE_VERSION 1
+
+enum trace_event_type : uint8_t {
+    TRACE_ALLOC,
+    TRACE_FREE,
+    TRACE_MMAP,
+    TRACE_MUNMAP,
+    TRACE_MREMAP,
+};
+
+// One event as recorded, and as written to trace files
+struct trace_event_s {
+    uint64_t timestamp; // Nanoseconds on the monotonic clock
+    uint64_t address;
+    uint64_t size;
+    uint32_t thread;    // Kernel thread id
+    uint8_t type;
+    uint8_t unused[3];
+};
+
+// Trace files start with this header, followed by the events of every thread
+struct trace_file_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;
+};
+
+typedef struct trace_event_s trace_event_s;
+typedef struct trace_file_header_s trace_file_header_s;
+
+static_assert(sizeof(trace_event_s) == 32, "trace_event_s is part of the trace file format");
+
+#ifdef ERIKMT_TRACE
+void trace_event(trace_event_type type, const void* address, size_t size);
+int erikmt_trace_dump(const char* path);
+#define trace(type, address, size) trace_event(type, address, size)
+#else
+#define trace(type, address, size) static_cast<void>(0)
+#endif
@@ -0,0 +1,66 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "trace.h"
+
+// Print a trace file written by erikmt_trace_dump() (or ERIKMT_TRACE_FILE)
+// as text, one event per line in timestamp order, followed by a summary.
+//
+// Usage: tracedump <trace file>
+
+static const char* type_names[] = { "alloc", "free", "mmap", "munmap", "mremap" };
+#define TRACE_TYPE_COUNT (sizeof(type_names) / sizeof(type_names[0]))
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+        return 2;
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if (!file) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    trace_file_header_s header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+        header.version != TRACE_VERSION || header.event_size != sizeof(trace_event_s)) {
+        fprintf(stderr, "%s: not an erikmtalloc trace file\n", argv[1]);
+        return 1;
+    }
+
+    std::vector<trace_event_s> events;
+    trace_event_s event;
+    while (fread(&event, sizeof(event), 1, file) == 1) {
+        events.push_back(event);
+    }
+    fclose(file);
+
+    std::stable_sort(events.begin(), events.end(), [](const trace_event_s& a, const trace_event_s& b) {
+        return a.timestamp < b.timestamp;
+    });
+
+    unsigned long long counts[TRACE_TYPE_COUNT] = {};
+    unsigned long long bytes[TRACE_TYPE_COUNT] = {};
+    uint64_t start = events.empty() ? 0 : events.front().timestamp;
+
+    for (const trace_event_s& e : events) {
+        const char* name = (e.type < TRACE_TYPE_COUNT) ? type_names[e.type] : "unknown";
+        printf("%14.6f %7u %-7s 0x%012llx %llu\n", (e.timestamp - start) / 1e9, e.thread, name,
+            static_cast<unsigned long long>(e.address), static_cast<unsigned long long>(e.size));
+
+        if (e.type < TRACE_TYPE_COUNT) {
+            counts[e.type] += 1;
+            bytes[e.type] += e.size;
+        }
+    }
+
+    printf("\n%zu events\n", events.size());
+    for (size_t i = 0; i < TRACE_TYPE_COUNT; ++i) {
+        printf("%-7s %12llu events %16llu bytes\n", type_names[i], counts[i], bytes[i]);
+    }
+    return 0;
+}
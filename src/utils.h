@@ -1,16 +1,23 @@
 #include <iostream>
 
+// Debug output is off unless built with `make DEBUG=1` (ERIKMT_DEBUG), since
+// it writes to std::cout under the allocator lock on every call.  The preload
+// library is always built with ERIKMT_NODEBUG, since it can't write to
+// std::cout from inside malloc().
+#if defined(ERIKMT_DEBUG) && !defined(ERIKMT_NODEBUG)
 #define DEBUG 1
+#endif
 
+#ifdef DEBUG
 template <typename Arg, typename... Args>
 void debug(std::ostream& out, Arg&& arg, Args&&... args)
 {
-#ifndef DEBUG
-    return;
-#endif
-
     out << "DEBUG: ";
     out << std::forward<Arg>(arg);
     ((out << ' ' << std::forward<Args>(args)), ...);
     out << std::endl;
-}
\ No newline at end of file
+}
+#else
+// Compiled out entirely, arguments included
+#define debug(...) static_cast<void>(0)
+#endif